@@ -0,0 +1,99 @@
+#include <getopt.h>
+
+#include "bench-common.h"
+
+/**
+ * Batch allocation
+ *
+ * A parser-like loop: allocate a batch of same sized nodes, touch
+ * them, free them all together. Once with a malloc()/free() per node
+ * and once with malloc_glue_alloc_batch()/malloc_glue_free_batch()
+ * (only when the glue is preloaded).
+ */
+
+static struct {
+    size_t batch;
+    size_t size;
+    size_t rounds;
+} opts = {
+    .batch = 64,
+    .size = 48,
+    .rounds = 200000
+};
+
+static size_t (*glue_alloc_batch)(size_t, size_t, void**);
+static void (*glue_free_batch)(void**, size_t);
+
+static void touch(void** ptrs) {
+    for (size_t i = 0; i < opts.batch; i++) {
+        *(volatile char*)ptrs[i] = (char)i;
+    }
+}
+
+static double run_single(void** ptrs) {
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < opts.rounds; r++) {
+        for (size_t i = 0; i < opts.batch; i++) {
+            ptrs[i] = malloc(opts.size);
+        }
+        touch(ptrs);
+        for (size_t i = 0; i < opts.batch; i++) {
+            free(ptrs[i]);
+        }
+    }
+    return (double)(bench_now_ns() - start) / (double)(opts.rounds * opts.batch);
+}
+
+static double run_batch(void** ptrs) {
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < opts.rounds; r++) {
+        if (glue_alloc_batch(opts.size, opts.batch, ptrs) != opts.batch) {
+            fprintf(stderr, "batch allocation failed\n");
+            exit(1);
+        }
+        touch(ptrs);
+        glue_free_batch(ptrs, opts.batch);
+    }
+    return (double)(bench_now_ns() - start) / (double)(opts.rounds * opts.batch);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n N      objects per batch (default 64)\n"
+            "  -s SIZE   object size (default 48)\n"
+            "  -r N      rounds (default 200000)\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:r:h")) != -1) {
+        switch (opt) {
+            case 'n': opts.batch = bench_parse_size(optarg); break;
+            case 's': opts.size = bench_parse_size(optarg); break;
+            case 'r': opts.rounds = bench_parse_size(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.batch == 0 || opts.size == 0 || opts.rounds == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    glue_alloc_batch = (size_t (*)(size_t, size_t, void**))dlsym(RTLD_DEFAULT, "malloc_glue_alloc_batch");
+    glue_free_batch = (void (*)(void**, size_t))dlsym(RTLD_DEFAULT, "malloc_glue_free_batch");
+    void** ptrs = calloc(opts.batch, sizeof(void*));
+
+    // warm up
+    run_single(ptrs);
+
+    bench_header("batch");
+    bench_result("single", run_single(ptrs), "ns/op");
+    if (glue_alloc_batch && glue_free_batch) {
+        bench_result("batch", run_batch(ptrs), "ns/op");
+    }
+
+    free(ptrs);
+    return bench_finish();
+}
@@ -0,0 +1,226 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+// g++ defines it already
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mimalloc-glue.h"
+
+/**
+ * Helpers shared by all benchmarks
+ *
+ * The benchmarks are plain programs calling malloc & friends.
+ * They are meant to be run once without anything preloaded (libc)
+ * and once with LD_PRELOAD=libmimalloc-glue.so (see run.sh)
+ * so glue symbols are looked up at runtime instead of linked.
+ */
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Read a "<field>: <n> kB" line from a /proc file in bytes
+ * Uses a stack buffer so sampling doesn't disturb the heap
+ * Returns 0 if the field can't be found
+ */
+static inline size_t bench_proc_kb_field(const char* path, const char* field) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    size_t field_len = strlen(field);
+    for (char* line = buf; line && *line; line = strchr(line, '\n')) {
+        if (*line == '\n') {
+            line++;
+        }
+        if (strncmp(line, field, field_len) == 0 && line[field_len] == ':') {
+            return strtoull(line + field_len + 1, NULL, 10) * 1024;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Resident set size of this process in bytes
+ */
+static inline size_t bench_rss_bytes(void) {
+    size_t rss = bench_proc_kb_field("/proc/self/smaps_rollup", "Rss");
+    if (rss == 0) {
+        // older kernels don't have smaps_rollup
+        rss = bench_proc_kb_field("/proc/self/status", "VmRSS");
+    }
+    return rss;
+}
+
+/**
+ * Name of the backend serving malloc
+ * "libc" if the glue isn't loaded
+ */
+static inline const char* bench_backend(void) {
+    const char* (*backend)(void) = (const char* (*)(void))dlsym(RTLD_DEFAULT, "malloc_glue_backend");
+    return backend ? backend() : "libc";
+}
+
+/**
+ * Bytes committed by the backend
+ * Falls back to glibc's own accounting if the glue isn't loaded
+ */
+static inline size_t bench_committed_bytes(void) {
+    size_t (*committed)(void) = (size_t (*)(void))dlsym(RTLD_DEFAULT, "malloc_glue_committed_bytes");
+    if (committed) {
+        size_t ret = committed();
+        return ret == MALLOC_GLUE_UNKNOWN ? 0 : ret;
+    }
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+/**
+ * Name of the configuration we are running under
+ * (set by run.sh, purely informational)
+ */
+static inline const char* bench_config(void) {
+    const char* config = getenv("MALLOC_GLUE_BENCH_CONFIG");
+    return config ? config : "default";
+}
+
+/**
+ * Parse a size with optional K/M/G suffix
+ */
+static inline size_t bench_parse_size(const char* str) {
+    char* end;
+    size_t size = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'g': case 'G': size <<= 10; // fall through
+        case 'm': case 'M': size <<= 10; // fall through
+        case 'k': case 'K': size <<= 10; break;
+        default: break;
+    }
+    return size;
+}
+
+/**
+ * Small and fast PRNG (xorshift64*)
+ * Deterministic so runs stay comparable
+ */
+static inline uint64_t bench_rand(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * Random allocation size in [min, max]
+ * skewed towards small sizes like most real programs
+ */
+static inline size_t bench_rand_size(uint64_t* state, size_t min, size_t max) {
+    uint64_t r = bench_rand(state);
+    size_t range = max - min + 1;
+    // squaring a uniform [0,1) value biases it towards 0
+    double u = (double)(r >> 11) / (double)(1ull << 53);
+    return min + (size_t)(u * u * (double)range);
+}
+
+/**
+ * Summary metrics of the current run
+ * kept around so they can also be written as JSON
+ */
+#define BENCH_MAX_RESULTS 128
+
+static struct {
+    const char* bench;
+    size_t count;
+    struct {
+        char name[64];
+        char unit[16];
+        double value;
+    } results[BENCH_MAX_RESULTS];
+} bench_run;
+
+/**
+ * Whether bigger values of a metric are an improvement
+ * (throughputs and counts), everything else is a cost
+ */
+static inline int bench_higher_is_better(const char* unit) {
+    size_t len = strlen(unit);
+    return strcmp(unit, "ops") == 0 || (len > 2 && strcmp(unit + len - 2, "/s") == 0);
+}
+
+/**
+ * Print a single summary metric
+ */
+static inline void bench_result(const char* name, double value, const char* unit) {
+    printf("%-24s %16.2f %s\n", name, value, unit);
+    if (bench_run.count < BENCH_MAX_RESULTS) {
+        snprintf(bench_run.results[bench_run.count].name, sizeof(bench_run.results[0].name), "%s", name);
+        snprintf(bench_run.results[bench_run.count].unit, sizeof(bench_run.results[0].unit), "%s", unit);
+        bench_run.results[bench_run.count].value = value;
+        bench_run.count++;
+    }
+}
+
+/**
+ * Print the header identifying a run
+ */
+static inline void bench_header(const char* bench) {
+    bench_run.bench = bench;
+    bench_run.count = 0;
+    printf("# %s backend=%s config=%s\n", bench, bench_backend(), bench_config());
+}
+
+/**
+ * Write the collected metrics as JSON to the file named by
+ * MALLOC_GLUE_BENCH_JSON (if set) for tools/bench-results.py
+ * Returns non-zero on failure so main() can pass it on
+ */
+static inline int bench_finish(void) {
+    const char* path = getenv("MALLOC_GLUE_BENCH_JSON");
+    if (!path || !*path) {
+        return 0;
+    }
+    FILE* json = fopen(path, "w");
+    if (!json) {
+        perror(path);
+        return 1;
+    }
+
+    fprintf(json, "{\n  \"benchmark\": \"%s\",\n  \"backend\": \"%s\",\n  \"config\": \"%s\",\n  \"results\": [",
+            bench_run.bench, bench_backend(), bench_config());
+    for (size_t i = 0; i < bench_run.count; i++) {
+        fprintf(json, "%s\n    {\"name\": \"%s\", \"value\": %.17g, \"unit\": \"%s\", \"higher_is_better\": %s}",
+                i ? "," : "", bench_run.results[i].name, bench_run.results[i].value, bench_run.results[i].unit,
+                bench_higher_is_better(bench_run.results[i].unit) ? "true" : "false");
+    }
+    fprintf(json, "\n  ]\n}\n");
+    return fclose(json) != 0;
+}
+
+#endif // BENCH_COMMON_H
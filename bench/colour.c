@@ -0,0 +1,195 @@
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "bench-common.h"
+
+/**
+ * Cache colouring
+ *
+ * A set of large, power of two sized buffers whose first cache lines
+ * (headers, descriptors) are read and written over and over. If all
+ * of them start page aligned those lines share a handful of cache
+ * sets and keep evicting each other although they would easily fit.
+ *
+ * Runs the loop over the buffers as malloc() returned them and over
+ * the same buffers with the start moved by one cache line per buffer
+ * by hand (what colouring should get close to), counting L1D and
+ * last level read misses with perf counters where available.
+ * Then times malloc() and free() of buffers of the same size, what
+ * colouring costs on the way in and out.
+ *
+ * Compare a plain run against MALLOC_GLUE_COLOUR=<size>.
+ */
+
+static struct {
+    size_t buffers;
+    size_t size;
+    size_t lines;
+    size_t rounds;
+} opts = {
+    .buffers = 128,
+    .size = 256 << 10,
+    .lines = 2,
+    .rounds = 20000
+};
+
+#define LINE 64
+
+/**
+ * Read miss counter for a cache (PERF_COUNT_HW_CACHE_*), -1 if the
+ * kernel or the machine doesn't let us
+ */
+static int counter_open(unsigned cache) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counter_start(int fd) {
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static double counter_stop(int fd) {
+    uint64_t value;
+    if (fd < 0) {
+        return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return -1;
+    }
+    return (double)value;
+}
+
+static int l1d_fd;
+static int llc_fd;
+
+/**
+ * Touch the first lines of every header, returns ns per line
+ * The misses per line end up in l1d/llc (-1 without counters)
+ */
+static double run(char** headers, double* l1d, double* llc) {
+    counter_start(l1d_fd);
+    counter_start(llc_fd);
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < opts.rounds; r++) {
+        for (size_t i = 0; i < opts.buffers; i++) {
+            for (size_t l = 0; l < opts.lines; l++) {
+                volatile uint64_t* line = (volatile uint64_t*)(headers[i] + l * LINE);
+                *line += r;
+            }
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    double accesses = (double)(opts.rounds * opts.buffers * opts.lines);
+    *l1d = counter_stop(l1d_fd);
+    *llc = counter_stop(llc_fd);
+    if (*l1d >= 0) {
+        *l1d /= accesses;
+    }
+    if (*llc >= 0) {
+        *llc /= accesses;
+    }
+    return (double)elapsed / accesses;
+}
+
+#define ALLOC_BATCH 64
+
+/**
+ * malloc() a batch of buffers, write their first line and free them
+ * again, returns ns per malloc()/free() pair
+ */
+static double alloc_free(void) {
+    void* batch[ALLOC_BATCH];
+    size_t rounds = opts.rounds / 10 + 1;
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < ALLOC_BATCH; i++) {
+            batch[i] = malloc(opts.size);
+            *(volatile char*)batch[i] = (char)r;
+        }
+        for (size_t i = 0; i < ALLOC_BATCH; i++) {
+            free(batch[i]);
+        }
+    }
+    return (double)(bench_now_ns() - start) / (double)(rounds * ALLOC_BATCH);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n N      buffers (default 128)\n"
+            "  -s SIZE   buffer size (default 256K)\n"
+            "  -l N      lines touched per buffer (default 2)\n"
+            "  -r N      rounds (default 20000)\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:l:r:h")) != -1) {
+        switch (opt) {
+            case 'n': opts.buffers = bench_parse_size(optarg); break;
+            case 's': opts.size = bench_parse_size(optarg); break;
+            case 'l': opts.lines = bench_parse_size(optarg); break;
+            case 'r': opts.rounds = bench_parse_size(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    // staggered headers may start up to a page into the buffer
+    if (opts.buffers == 0 || opts.lines == 0 || opts.rounds == 0 || opts.size < 4096 + opts.lines * LINE) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char** buffers = calloc(opts.buffers, sizeof(char*));
+    char** staggered = calloc(opts.buffers, sizeof(char*));
+    size_t page_offsets = 0;
+    for (size_t i = 0; i < opts.buffers; i++) {
+        buffers[i] = malloc(opts.size);
+        memset(buffers[i], 0, opts.size);
+        page_offsets += ((uintptr_t)buffers[i] & 4095) != 0;
+        // one line further for every buffer, wrapping at the page
+        staggered[i] = (char*)(((uintptr_t)buffers[i] & ~(uintptr_t)4095) + (i * LINE) % 4096);
+        if (staggered[i] < buffers[i]) {
+            staggered[i] += 4096;
+        }
+    }
+    l1d_fd = counter_open(PERF_COUNT_HW_CACHE_L1D);
+    llc_fd = counter_open(PERF_COUNT_HW_CACHE_LL);
+
+    double l1d, llc;
+    // warm up
+    run(buffers, &l1d, &llc);
+
+    bench_header("colour");
+    bench_result("offset_buffers", (double)page_offsets, "count");
+    bench_result("returned", run(buffers, &l1d, &llc), "ns/op");
+    bench_result("returned_l1d_miss", l1d, "miss/op");
+    bench_result("returned_llc_miss", llc, "miss/op");
+    bench_result("staggered", run(staggered, &l1d, &llc), "ns/op");
+    bench_result("staggered_l1d_miss", l1d, "miss/op");
+    bench_result("staggered_llc_miss", llc, "miss/op");
+    bench_result("alloc_free", alloc_free(), "ns/op");
+    if (l1d_fd < 0) {
+        fprintf(stderr, "no perf counters (perf_event_paranoid?), miss counts are -1\n");
+    }
+
+    for (size_t i = 0; i < opts.buffers; i++) {
+        free(buffers[i]);
+    }
+    free(staggered);
+    free(buffers);
+    return bench_finish();
+}
@@ -0,0 +1,151 @@
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "bench-common.h"
+
+/**
+ * First request latency
+ *
+ * Simulates a freshly started service: every request allocates a
+ * working set of mixed size objects, touches them and keeps a part
+ * alive (caches, sessions), so the heap keeps growing into pages
+ * nobody touched before. Early requests pay for those page faults,
+ * which is what MALLOC_GLUE_PREWARM is meant to take off them.
+ *
+ * Reports the latency and minor faults of the first requests
+ * against the steady state at the end of the run.
+ */
+
+static struct {
+    unsigned requests;
+    unsigned first;
+    size_t working_set;
+    size_t max_size;
+    unsigned keep_percent;
+    unsigned delay_ms;
+} opts = {
+    .requests = 500,
+    .first = 10,
+    .working_set = 256 << 10,
+    .max_size = 4096,
+    .keep_percent = 25,
+    .delay_ms = 0
+};
+
+static long minor_faults(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -r N      requests (default 500)\n"
+            "  -f N      requests that count as first (default 10)\n"
+            "  -w SIZE   allocated per request (default 256K)\n"
+            "  -M SIZE   maximum object size (default 4K)\n"
+            "  -k PCT    percent of objects kept alive (default 25)\n"
+            "  -d MS     wait before the first request (default 0)\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:w:M:k:d:h")) != -1) {
+        switch (opt) {
+            case 'r': opts.requests = (unsigned)atoi(optarg); break;
+            case 'f': opts.first = (unsigned)atoi(optarg); break;
+            case 'w': opts.working_set = bench_parse_size(optarg); break;
+            case 'M': opts.max_size = bench_parse_size(optarg); break;
+            case 'k': opts.keep_percent = (unsigned)atoi(optarg); break;
+            case 'd': opts.delay_ms = (unsigned)atoi(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.first == 0 || opts.requests < opts.first * 2 || opts.max_size < 16 || opts.keep_percent > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // everything the measurement needs is allocated before the first request
+    size_t max_objs = opts.working_set / 16 + 1;
+    void** objs = calloc(max_objs, sizeof(void*));
+    size_t kept_cap = max_objs * opts.requests * opts.keep_percent / 100 + max_objs;
+    void** kept = calloc(kept_cap, sizeof(void*));
+    uint64_t* latency = calloc(opts.requests, sizeof(uint64_t));
+    long* faults = calloc(opts.requests, sizeof(long));
+    size_t nkept = 0;
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+    if (opts.delay_ms) {
+        struct timespec delay = {
+            .tv_sec = opts.delay_ms / 1000,
+            .tv_nsec = (long)(opts.delay_ms % 1000) * 1000000
+        };
+        nanosleep(&delay, NULL);
+    }
+
+    for (unsigned r = 0; r < opts.requests; r++) {
+        long faults_before = minor_faults();
+        uint64_t start = bench_now_ns();
+
+        size_t nobjs = 0;
+        for (size_t used = 0; used < opts.working_set && nobjs < max_objs;) {
+            size_t size = bench_rand_size(&rng, 16, opts.max_size);
+            objs[nobjs] = malloc(size);
+            memset(objs[nobjs], (int)r, size);
+            used += size;
+            nobjs++;
+        }
+        for (size_t i = 0; i < nobjs; i++) {
+            if (bench_rand(&rng) % 100 < opts.keep_percent && nkept < kept_cap) {
+                kept[nkept++] = objs[i];
+            } else {
+                free(objs[i]);
+            }
+        }
+
+        latency[r] = bench_now_ns() - start;
+        faults[r] = minor_faults() - faults_before;
+    }
+
+    double first_mean = 0;
+    long first_faults = 0;
+    for (unsigned r = 0; r < opts.first; r++) {
+        first_mean += (double)latency[r];
+        first_faults += faults[r];
+    }
+    first_mean /= opts.first;
+
+    // steady state: the last `first` requests
+    long steady_faults = 0;
+    for (unsigned r = opts.requests - opts.first; r < opts.requests; r++) {
+        steady_faults += faults[r];
+    }
+    uint64_t first_request = latency[0];
+    qsort(latency + opts.requests - opts.first, opts.first, sizeof(uint64_t), compare_u64);
+    double steady_median = (double)latency[opts.requests - opts.first / 2 - 1];
+
+    bench_header("firsttouch");
+    bench_result("first_request", (double)first_request / 1e3, "us");
+    bench_result("first_requests_mean", first_mean / 1e3, "us");
+    bench_result("steady_median", steady_median / 1e3, "us");
+    bench_result("first_faults", (double)first_faults, "faults");
+    bench_result("steady_faults", (double)steady_faults, "faults");
+
+    for (size_t i = 0; i < nkept; i++) {
+        free(kept[i]);
+    }
+    free(faults);
+    free(latency);
+    free(kept);
+    free(objs);
+    return bench_finish();
+}
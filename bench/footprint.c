@@ -0,0 +1,309 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "bench-common.h"
+
+/**
+ * Memory footprint over time
+ *
+ * Runs a phase-changing workload:
+ *   build    - allocate a large heap
+ *   free     - free 90% of it in random order
+ *   idle     - do nothing for a while
+ *   rebuild  - allocate back up to the original size
+ *   teardown - free everything
+ * while a sampler thread records RSS and backend committed bytes
+ * at a fixed interval.
+ *
+ * The time series goes to a CSV file, summary metrics to stdout.
+ */
+
+enum phase {
+    PHASE_BUILD,
+    PHASE_FREE,
+    PHASE_IDLE,
+    PHASE_REBUILD,
+    PHASE_TEARDOWN,
+    PHASE_DONE
+};
+
+static const char* phase_names[] = {
+    "build",
+    "free",
+    "idle",
+    "rebuild",
+    "teardown",
+    "done"
+};
+
+typedef struct sample {
+    uint64_t t_ns;
+    size_t rss;
+    size_t committed;
+    int phase;
+} sample;
+
+static struct {
+    size_t heap_size;
+    size_t min_size;
+    size_t max_size;
+    unsigned interval_ms;
+    unsigned idle_ms;
+    unsigned threads;
+    size_t max_samples;
+    const char* csv;
+} opts = {
+    .heap_size = 1ul << 30,
+    .min_size = 16,
+    .max_size = 4096,
+    .interval_ms = 10,
+    .idle_ms = 3000,
+    .threads = 1,
+    .max_samples = 1ul << 16,
+    .csv = NULL
+};
+
+static atomic_int phase = PHASE_BUILD;
+static pthread_barrier_t barrier;
+
+static sample* samples;
+static size_t nsamples = 0;
+static uint64_t start_ns;
+
+/**
+ * Record a sample every interval until the workload is done
+ */
+static void* sampler(void* arg) {
+    (void)arg;
+    struct timespec interval = {
+        .tv_sec = opts.interval_ms / 1000,
+        .tv_nsec = (long)(opts.interval_ms % 1000) * 1000000
+    };
+
+    for (;;) {
+        int current = atomic_load(&phase);
+        if (nsamples < opts.max_samples) {
+            samples[nsamples++] = (sample){
+                .t_ns = bench_now_ns() - start_ns,
+                .rss = bench_rss_bytes(),
+                .committed = bench_committed_bytes(),
+                .phase = current
+            };
+        }
+        if (current == PHASE_DONE) {
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+typedef struct worker_state {
+    uint64_t rng;
+    void** objs;
+    size_t nobjs;
+    size_t cap;
+} worker_state;
+
+/**
+ * Allocate until this worker's share of the heap is reached
+ * touching every object so it actually counts towards RSS
+ */
+static void fill(worker_state* w) {
+    size_t share = opts.heap_size / opts.threads;
+    size_t live = 0;
+    for (size_t i = 0; i < w->nobjs; i++) {
+        if (w->objs[i]) {
+            live += malloc_usable_size(w->objs[i]);
+        }
+    }
+
+    for (size_t i = 0; live < share; i++) {
+        if (i == w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 1024;
+            w->objs = realloc(w->objs, w->cap * sizeof(void*));
+            memset(w->objs + i, 0, (w->cap - i) * sizeof(void*));
+        }
+        if (w->objs[i]) {
+            continue;
+        }
+        size_t size = bench_rand_size(&w->rng, opts.min_size, opts.max_size);
+        w->objs[i] = malloc(size);
+        memset(w->objs[i], 0xa5, size);
+        live += size;
+        if (i >= w->nobjs) {
+            w->nobjs = i + 1;
+        }
+    }
+}
+
+/**
+ * Free a random fraction (in percent) of the live objects
+ */
+static void drain(worker_state* w, unsigned percent) {
+    for (size_t i = 0; i < w->nobjs; i++) {
+        if (w->objs[i] && bench_rand(&w->rng) % 100 < percent) {
+            free(w->objs[i]);
+            w->objs[i] = NULL;
+        }
+    }
+}
+
+static void* worker(void* arg) {
+    worker_state* w = arg;
+
+    fill(w);
+    pthread_barrier_wait(&barrier); // build done
+    pthread_barrier_wait(&barrier); // free start
+    drain(w, 90);
+    pthread_barrier_wait(&barrier); // free done
+    pthread_barrier_wait(&barrier); // rebuild start
+    fill(w);
+    pthread_barrier_wait(&barrier); // rebuild done
+    pthread_barrier_wait(&barrier); // teardown start
+    drain(w, 100);
+    free(w->objs);
+    pthread_barrier_wait(&barrier); // teardown done
+    return NULL;
+}
+
+/**
+ * Advance all workers to the next phase
+ */
+static void next_phase(int next) {
+    atomic_store(&phase, next);
+    pthread_barrier_wait(&barrier);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s SIZE   heap size to build (default 1G)\n"
+            "  -m SIZE   minimum object size (default 16)\n"
+            "  -M SIZE   maximum object size (default 4K)\n"
+            "  -t N      worker threads (default 1)\n"
+            "  -i MS     sampling interval (default 10)\n"
+            "  -I MS     idle phase length (default 3000)\n"
+            "  -o FILE   write the time series CSV to FILE (default stdout)\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:M:t:i:I:o:h")) != -1) {
+        switch (opt) {
+            case 's': opts.heap_size = bench_parse_size(optarg); break;
+            case 'm': opts.min_size = bench_parse_size(optarg); break;
+            case 'M': opts.max_size = bench_parse_size(optarg); break;
+            case 't': opts.threads = (unsigned)atoi(optarg); break;
+            case 'i': opts.interval_ms = (unsigned)atoi(optarg); break;
+            case 'I': opts.idle_ms = (unsigned)atoi(optarg); break;
+            case 'o': opts.csv = optarg; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.threads == 0 || opts.interval_ms == 0 || opts.min_size == 0 || opts.min_size > opts.max_size) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* csv = opts.csv ? fopen(opts.csv, "w") : stdout;
+    if (!csv) {
+        perror(opts.csv);
+        return 1;
+    }
+
+    // allocate everything the sampler needs up front
+    samples = calloc(opts.max_samples, sizeof(sample));
+    worker_state* workers = calloc(opts.threads, sizeof(worker_state));
+    pthread_t* tids = calloc(opts.threads, sizeof(pthread_t));
+    pthread_barrier_init(&barrier, NULL, opts.threads + 1);
+
+    start_ns = bench_now_ns();
+    pthread_t sampler_tid;
+    pthread_create(&sampler_tid, NULL, sampler, NULL);
+
+    for (unsigned i = 0; i < opts.threads; i++) {
+        workers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&tids[i], NULL, worker, &workers[i]);
+    }
+
+    pthread_barrier_wait(&barrier); // build done
+    uint64_t free_start = bench_now_ns() - start_ns;
+    next_phase(PHASE_FREE);
+    pthread_barrier_wait(&barrier); // free done
+    uint64_t free_end = bench_now_ns() - start_ns;
+
+    atomic_store(&phase, PHASE_IDLE);
+    struct timespec idle = {
+        .tv_sec = opts.idle_ms / 1000,
+        .tv_nsec = (long)(opts.idle_ms % 1000) * 1000000
+    };
+    nanosleep(&idle, NULL);
+    size_t rss_after_idle = bench_rss_bytes();
+    size_t committed_after_idle = bench_committed_bytes();
+
+    next_phase(PHASE_REBUILD);
+    pthread_barrier_wait(&barrier); // rebuild done
+    next_phase(PHASE_TEARDOWN);
+    pthread_barrier_wait(&barrier); // teardown done
+    atomic_store(&phase, PHASE_DONE);
+
+    for (unsigned i = 0; i < opts.threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_join(sampler_tid, NULL);
+
+    fprintf(csv, "t_ms,phase,rss_bytes,committed_bytes\n");
+    size_t peak_rss = 0;
+    size_t peak_committed = 0;
+    size_t rss_before_free = 0;
+    for (size_t i = 0; i < nsamples; i++) {
+        sample* s = &samples[i];
+        fprintf(csv, "%.3f,%s,%zu,%zu\n", (double)s->t_ns / 1e6, phase_names[s->phase], s->rss, s->committed);
+        if (s->rss > peak_rss) {
+            peak_rss = s->rss;
+        }
+        if (s->committed > peak_committed) {
+            peak_committed = s->committed;
+        }
+        if (s->t_ns <= free_start) {
+            rss_before_free = s->rss;
+        }
+    }
+    if (csv != stdout) {
+        fclose(csv);
+    }
+
+    // memory counts as returned once RSS is within 10% of
+    // where it settled after idling
+    // if it never dropped by at least 5% of the peak it was never returned
+    double returned_ms = -1;
+    if (rss_before_free > rss_after_idle && rss_before_free - rss_after_idle >= peak_rss / 20) {
+        size_t target = rss_after_idle + (rss_before_free - rss_after_idle) / 10;
+        for (size_t i = 0; i < nsamples; i++) {
+            if (samples[i].t_ns >= free_start && samples[i].rss <= target) {
+                uint64_t t = samples[i].t_ns > free_end ? samples[i].t_ns - free_end : 0;
+                returned_ms = (double)t / 1e6;
+                break;
+            }
+        }
+    }
+
+    bench_header("footprint");
+    bench_result("peak_rss", (double)peak_rss / (1 << 20), "MiB");
+    bench_result("peak_committed", (double)peak_committed / (1 << 20), "MiB");
+    bench_result("rss_after_idle", (double)rss_after_idle / (1 << 20), "MiB");
+    bench_result("committed_after_idle", (double)committed_after_idle / (1 << 20), "MiB");
+    bench_result("time_to_return", returned_ms, "ms");
+    if (nsamples == opts.max_samples) {
+        fprintf(stderr, "warning: sample buffer full, time series truncated\n");
+    }
+
+    free(tids);
+    free(workers);
+    free(samples);
+    return bench_finish();
+}
@@ -0,0 +1,102 @@
+#ifndef BENCH_HDR_H
+#define BENCH_HDR_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Minimal HDR (high dynamic range) histogram for nanosecond latencies
+ *
+ * Values below 2048 are recorded exactly, above that every power of two
+ * is split into 1024 linear sub-buckets so the relative error stays
+ * below 0.1% all the way up to ~18 minutes.
+ * Recording is a couple of shifts and an increment so it's cheap
+ * enough to do for every single operation.
+ */
+
+#define HDR_SUB_BITS 10
+#define HDR_SUB_COUNT (1u << HDR_SUB_BITS)
+#define HDR_MAX_BITS 40
+#define HDR_BUCKETS (2 * HDR_SUB_COUNT + (HDR_MAX_BITS - HDR_SUB_BITS - 1) * HDR_SUB_COUNT)
+
+typedef struct hdr_histogram {
+    uint64_t total;
+    uint64_t max;
+    uint64_t counts[HDR_BUCKETS];
+} hdr_histogram;
+
+static inline hdr_histogram* hdr_new(void) {
+    return calloc(1, sizeof(hdr_histogram));
+}
+
+static inline size_t hdr_index(uint64_t value) {
+    if (value < 2 * HDR_SUB_COUNT) {
+        return (size_t)value;
+    }
+    unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+    if (msb >= HDR_MAX_BITS) {
+        return HDR_BUCKETS - 1;
+    }
+    unsigned shift = msb - HDR_SUB_BITS;
+    return 2 * HDR_SUB_COUNT + (size_t)(shift - 1) * HDR_SUB_COUNT + (size_t)((value >> shift) - HDR_SUB_COUNT);
+}
+
+/**
+ * Highest value that maps to the same bucket as index
+ */
+static inline uint64_t hdr_bucket_max(size_t index) {
+    if (index < 2 * HDR_SUB_COUNT) {
+        return index;
+    }
+    size_t rel = index - 2 * HDR_SUB_COUNT;
+    unsigned shift = (unsigned)(rel / HDR_SUB_COUNT) + 1;
+    uint64_t sub = rel % HDR_SUB_COUNT + HDR_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void hdr_record(hdr_histogram* h, uint64_t value) {
+    h->counts[hdr_index(value)]++;
+    h->total++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+/**
+ * Add all values recorded in src to dst
+ */
+static inline void hdr_merge(hdr_histogram* dst, const hdr_histogram* src) {
+    for (size_t i = 0; i < HDR_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/**
+ * Value at the given percentile (0-100)
+ * reported as the upper bound of its bucket
+ */
+static inline uint64_t hdr_percentile(const hdr_histogram* h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)((percentile / 100.0) * (double)h->total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HDR_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = hdr_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif // BENCH_HDR_H
@@ -0,0 +1,215 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+#include "bench-common.h"
+#include "hdr.h"
+
+/**
+ * Allocation tail latency under purge and page-fault pressure
+ *
+ * Mixer threads keep a steady mix of small allocations and frees going
+ * and record the latency of every single operation in HDR histograms.
+ * Meanwhile churn threads allocate, touch and free large blocks
+ * (making the backend commit/decommit and purge) and an optional balloon
+ * thread maps and unmaps anonymous memory behind malloc's back
+ * to add page-fault pressure.
+ *
+ * malloc latency includes writing the first byte of the block
+ * so faults on fresh pages are attributed to the allocation
+ * that caused them.
+ */
+
+static struct {
+    unsigned mixers;
+    unsigned churners;
+    unsigned seconds;
+    size_t min_size;
+    size_t max_size;
+    size_t live;
+    size_t churn_max;
+    size_t balloon;
+} opts = {
+    .mixers = 4,
+    .churners = 2,
+    .seconds = 5,
+    .min_size = 16,
+    .max_size = 1024,
+    .live = 4096,
+    .churn_max = 64ul << 20,
+    .balloon = 0
+};
+
+static atomic_bool stop = false;
+
+typedef struct mixer_state {
+    pthread_t tid;
+    uint64_t rng;
+    hdr_histogram* malloc_hist;
+    hdr_histogram* free_hist;
+} mixer_state;
+
+static void* mixer(void* arg) {
+    mixer_state* m = arg;
+    void** slots = calloc(opts.live, sizeof(void*));
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        size_t slot = bench_rand(&m->rng) % opts.live;
+        if (slots[slot]) {
+            uint64_t start = bench_now_ns();
+            free(slots[slot]);
+            hdr_record(m->free_hist, bench_now_ns() - start);
+            slots[slot] = NULL;
+        } else {
+            size_t size = bench_rand_size(&m->rng, opts.min_size, opts.max_size);
+            uint64_t start = bench_now_ns();
+            char* p = malloc(size);
+            *(volatile char*)p = 1;
+            hdr_record(m->malloc_hist, bench_now_ns() - start);
+            slots[slot] = p;
+        }
+    }
+
+    for (size_t i = 0; i < opts.live; i++) {
+        free(slots[i]);
+    }
+    free(slots);
+    return NULL;
+}
+
+/**
+ * Allocate, touch and free large blocks
+ */
+static void* churner(void* arg) {
+    uint64_t rng = (uintptr_t)arg;
+    long page = sysconf(_SC_PAGESIZE);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        size_t size = bench_rand_size(&rng, 1 << 20, opts.churn_max);
+        char* p = malloc(size);
+        for (size_t i = 0; i < size; i += (size_t)page) {
+            p[i] = 1;
+        }
+        free(p);
+    }
+    return NULL;
+}
+
+/**
+ * Repeatedly fault in and drop anonymous memory
+ * outside of the allocator
+ */
+static void* balloon(void* arg) {
+    (void)arg;
+    long page = sysconf(_SC_PAGESIZE);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        char* p = mmap(NULL, opts.balloon, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        for (size_t i = 0; i < opts.balloon; i += (size_t)page) {
+            p[i] = 1;
+        }
+        munmap(p, opts.balloon);
+    }
+    return NULL;
+}
+
+static void report(const char* op, const hdr_histogram* h) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_p50", op);
+    bench_result(name, (double)hdr_percentile(h, 50.0), "ns");
+    snprintf(name, sizeof(name), "%s_p99", op);
+    bench_result(name, (double)hdr_percentile(h, 99.0), "ns");
+    snprintf(name, sizeof(name), "%s_p99.9", op);
+    bench_result(name, (double)hdr_percentile(h, 99.9), "ns");
+    snprintf(name, sizeof(name), "%s_max", op);
+    bench_result(name, (double)h->max, "ns");
+    snprintf(name, sizeof(name), "%s_ops", op);
+    bench_result(name, (double)h->total, "ops");
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t N      mixer threads (default 4)\n"
+            "  -c N      large block churn threads (default 2)\n"
+            "  -d SEC    duration (default 5)\n"
+            "  -m SIZE   minimum mixer allocation (default 16)\n"
+            "  -M SIZE   maximum mixer allocation (default 1K)\n"
+            "  -l N      live objects per mixer (default 4096)\n"
+            "  -C SIZE   maximum churn block size (default 64M)\n"
+            "  -b SIZE   balloon size for page-fault pressure (default off)\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:m:M:l:C:b:h")) != -1) {
+        switch (opt) {
+            case 't': opts.mixers = (unsigned)atoi(optarg); break;
+            case 'c': opts.churners = (unsigned)atoi(optarg); break;
+            case 'd': opts.seconds = (unsigned)atoi(optarg); break;
+            case 'm': opts.min_size = bench_parse_size(optarg); break;
+            case 'M': opts.max_size = bench_parse_size(optarg); break;
+            case 'l': opts.live = bench_parse_size(optarg); break;
+            case 'C': opts.churn_max = bench_parse_size(optarg); break;
+            case 'b': opts.balloon = bench_parse_size(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.mixers == 0 || opts.live == 0 || opts.min_size == 0 || opts.min_size > opts.max_size ||
+        opts.churn_max < (1 << 20)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mixer_state* mixers = calloc(opts.mixers, sizeof(mixer_state));
+    pthread_t* others = calloc(opts.churners + 1, sizeof(pthread_t));
+
+    for (unsigned i = 0; i < opts.mixers; i++) {
+        mixers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        mixers[i].malloc_hist = hdr_new();
+        mixers[i].free_hist = hdr_new();
+        pthread_create(&mixers[i].tid, NULL, mixer, &mixers[i]);
+    }
+    for (unsigned i = 0; i < opts.churners; i++) {
+        pthread_create(&others[i], NULL, churner, (void*)(uintptr_t)(0xc0ffeeull * (i + 1)));
+    }
+    if (opts.balloon) {
+        pthread_create(&others[opts.churners], NULL, balloon, NULL);
+    }
+
+    sleep(opts.seconds);
+    atomic_store(&stop, true);
+
+    hdr_histogram* malloc_hist = hdr_new();
+    hdr_histogram* free_hist = hdr_new();
+    for (unsigned i = 0; i < opts.mixers; i++) {
+        pthread_join(mixers[i].tid, NULL);
+        hdr_merge(malloc_hist, mixers[i].malloc_hist);
+        hdr_merge(free_hist, mixers[i].free_hist);
+        free(mixers[i].malloc_hist);
+        free(mixers[i].free_hist);
+    }
+    for (unsigned i = 0; i < opts.churners; i++) {
+        pthread_join(others[i], NULL);
+    }
+    if (opts.balloon) {
+        pthread_join(others[opts.churners], NULL);
+    }
+
+    bench_header("latency");
+    report("malloc", malloc_hist);
+    report("free", free_hist);
+
+    free(malloc_hist);
+    free(free_hist);
+    free(others);
+    free(mixers);
+    return bench_finish();
+}
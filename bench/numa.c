@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+
+#include "bench-common.h"
+
+/**
+ * NUMA locality
+ *
+ * Worker threads get moved to a different CPU every round
+ * (like the scheduler does on a busy box), then allocate and
+ * touch a batch of blocks. move_pages() tells us which node
+ * every page ended up on, so we can count how much memory is
+ * remote to the node the thread is running on.
+ *
+ * Compare a plain run against MALLOC_GLUE_NUMA=1.
+ * On single-node machines every page is local, run it with
+ * MALLOC_GLUE_NUMA_FAKE to at least see the threads getting rebound.
+ */
+
+static struct {
+    unsigned threads;
+    unsigned rounds;
+    size_t blocks;
+    size_t size;
+    bool migrate;
+} opts = {
+    .threads = 0,
+    .rounds = 50,
+    .blocks = 256,
+    .size = 64 << 10,
+    .migrate = true
+};
+
+static int cpus[1024];
+static unsigned ncpus = 0;
+static long page_size;
+static int (*glue_numa_node)(void);
+
+typedef struct worker_state {
+    unsigned id;
+    size_t local;
+    size_t remote;
+    size_t unknown;
+    size_t rebinds;
+    uint64_t alloc_ns;
+} worker_state;
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+/**
+ * Count the pages of the blocks that live on node
+ */
+static void classify(worker_state* w, void** blocks, int node) {
+    size_t per_block = (opts.size + (size_t)page_size - 1) / (size_t)page_size;
+    void* pages[256];
+    int status[256];
+    size_t count = 0;
+
+    for (size_t i = 0; i < opts.blocks; i++) {
+        uintptr_t first = (uintptr_t)blocks[i] & ~((uintptr_t)page_size - 1);
+        for (size_t p = 0; p < per_block; p++) {
+            pages[count++] = (void*)(first + p * (size_t)page_size);
+            if (count == 256 || (i == opts.blocks - 1 && p == per_block - 1)) {
+                // nodes == NULL only queries where the pages are
+                if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) != 0) {
+                    w->unknown += count;
+                } else {
+                    for (size_t k = 0; k < count; k++) {
+                        if (status[k] < 0) {
+                            w->unknown++;
+                        } else if (status[k] == node) {
+                            w->local++;
+                        } else {
+                            w->remote++;
+                        }
+                    }
+                }
+                count = 0;
+            }
+        }
+    }
+}
+
+static void* worker(void* arg) {
+    worker_state* w = arg;
+    void** blocks = calloc(opts.blocks, sizeof(void*));
+    int last_node = -1;
+
+    for (unsigned round = 0; round < opts.rounds; round++) {
+        if (opts.migrate && ncpus > 1) {
+            pin(cpus[(w->id + round) % ncpus]);
+        }
+        unsigned cpu, node;
+        if (getcpu(&cpu, &node) != 0) {
+            node = 0;
+        }
+
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < opts.blocks; i++) {
+            blocks[i] = malloc(opts.size);
+            memset(blocks[i], 0x5a, opts.size);
+        }
+        w->alloc_ns += bench_now_ns() - start;
+
+        int glue_node = glue_numa_node ? glue_numa_node() : -1;
+        if (glue_node != last_node) {
+            w->rebinds += last_node != -1;
+            last_node = glue_node;
+        }
+
+        classify(w, blocks, (int)node);
+        for (size_t i = 0; i < opts.blocks; i++) {
+            free(blocks[i]);
+        }
+    }
+    free(blocks);
+    return NULL;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t N      worker threads (default one per CPU)\n"
+            "  -r N      rounds per thread (default 50)\n"
+            "  -n N      blocks per round (default 256)\n"
+            "  -s SIZE   block size (default 64K)\n"
+            "  -p        don't move threads between CPUs\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:r:n:s:ph")) != -1) {
+        switch (opt) {
+            case 't': opts.threads = (unsigned)atoi(optarg); break;
+            case 'r': opts.rounds = (unsigned)atoi(optarg); break;
+            case 'n': opts.blocks = bench_parse_size(optarg); break;
+            case 's': opts.size = bench_parse_size(optarg); break;
+            case 'p': opts.migrate = false; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.rounds == 0 || opts.blocks == 0 || opts.size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE && ncpus < sizeof(cpus) / sizeof(cpus[0]); cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[ncpus++] = cpu;
+        }
+    }
+    if (opts.threads == 0) {
+        opts.threads = ncpus;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+    glue_numa_node = (int (*)(void))dlsym(RTLD_DEFAULT, "malloc_glue_numa_node");
+
+    worker_state* workers = calloc(opts.threads, sizeof(worker_state));
+    pthread_t* tids = calloc(opts.threads, sizeof(pthread_t));
+    uint64_t start = bench_now_ns();
+    for (unsigned i = 0; i < opts.threads; i++) {
+        workers[i].id = i;
+        pthread_create(&tids[i], NULL, worker, &workers[i]);
+    }
+
+    worker_state total = { 0 };
+    for (unsigned i = 0; i < opts.threads; i++) {
+        pthread_join(tids[i], NULL);
+        total.local += workers[i].local;
+        total.remote += workers[i].remote;
+        total.unknown += workers[i].unknown;
+        total.rebinds += workers[i].rebinds;
+        total.alloc_ns += workers[i].alloc_ns;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    size_t known = total.local + total.remote;
+    size_t allocs = (size_t)opts.threads * opts.rounds * opts.blocks;
+    bench_header("numa");
+    bench_result("remote_pages", known ? 100.0 * (double)total.remote / (double)known : 0, "%");
+    bench_result("unknown_pages", (double)total.unknown, "pages");
+    bench_result("heap_rebinds", (double)total.rebinds, "count");
+    bench_result("alloc_touch", (double)total.alloc_ns / (double)allocs, "ns/op");
+    bench_result("elapsed", (double)elapsed / 1e6, "ms");
+
+    free(tids);
+    free(workers);
+    return bench_finish();
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# Run a benchmark under every backend and configuration
+#
+# usage: run.sh [-g path/to/libmimalloc-glue.so] [-c "name:VAR=value VAR=value"]... \
+#               [-o outdir] [-j] bench [bench args...]
+#
+# Each run gets MALLOC_GLUE_BENCH_CONFIG set to the configuration name.
+# The "libc" backend is always run without anything preloaded.
+# If no -c is given a single "default" configuration is used.
+# Any "@OUT@" in the bench args is replaced by a per-run file prefix
+# in outdir (e.g. "-o @OUT@.csv").
+# With -j every run also writes its summary as JSON to outdir
+# (see tools/bench-results.py).
+
+set -eu
+
+glue="$(dirname "$0")/../libmimalloc-glue.so"
+outdir="."
+configs=""
+json=""
+
+while getopts "g:c:o:j" opt; do
+    case "$opt" in
+        g) glue="$OPTARG" ;;
+        c) configs="$configs$OPTARG
+" ;;
+        o) outdir="$OPTARG" ;;
+        j) json=1 ;;
+        *) sed -n '2,13s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    sed -n '2,13s/^# \{0,1\}//p' "$0" >&2
+    exit 1
+fi
+
+[ -n "$configs" ] || configs="default:
+"
+
+bench="$1"
+shift
+name="$(basename "$bench")"
+mkdir -p "$outdir"
+
+# run_one backend config env args...
+run_one() {
+    backend="$1"
+    config="$2"
+    env="$3"
+    shift 3
+    prefix="$outdir/$name-$backend-$config"
+
+    args=""
+    for arg in "$@"; do
+        args="$args '$(printf '%s' "$arg" | sed "s|@OUT@|$prefix|g; s|'|'\\\\''|g")'"
+    done
+
+    if [ -n "$json" ]; then
+        env="MALLOC_GLUE_BENCH_JSON='$prefix.json' $env"
+    fi
+
+    echo "== $name backend=$backend config=$config" >&2
+    if [ "$backend" = libc ]; then
+        eval "env MALLOC_GLUE_BENCH_CONFIG='$config' $env '$bench' $args"
+    else
+        eval "env MALLOC_GLUE_BENCH_CONFIG='$config' LD_PRELOAD='$glue' $env '$bench' $args"
+    fi
+}
+
+printf '%s' "$configs" | while IFS= read -r line; do
+    [ -n "$line" ] || continue
+    config="${line%%:*}"
+    env="${line#*:}"
+    run_one libc "$config" "$env" "$@"
+    run_one glue "$config" "$env" "$@"
+done
@@ -0,0 +1,143 @@
+#include <getopt.h>
+
+#include <new>
+
+#include "bench-common.h"
+#include "mimalloc-glue.hpp"
+
+/**
+ * Typed allocation against plain new/delete
+ *
+ * Object churn: a pool of live objects of a few fixed sizes, every
+ * operation replaces a random one (delete the old object, create a
+ * new one and touch it). The same loop runs with
+ *
+ *   new      plain new/delete
+ *   typed    glue::make<T>()/glue::destroy()
+ *   class    new/delete of classes deriving from glue::typed_new<T>
+ *
+ * Without the glue preloaded the typed variants fall back to
+ * new/delete, so compare runs under LD_PRELOAD.
+ */
+
+static struct {
+    size_t live;
+    size_t ops;
+} opts = {
+    .live = 10000,
+    .ops = 10000000
+};
+
+template <size_t N>
+struct plain_obj {
+    char data[N];
+};
+
+template <size_t N>
+struct class_obj : glue::typed_new<class_obj<N>> {
+    char data[N];
+};
+
+struct plain_new {
+    template <template <size_t> class T, size_t N>
+    static T<N>* make() { return new T<N>; }
+    template <typename T>
+    static void destroy(T* p) { delete p; }
+};
+
+struct typed_new {
+    template <template <size_t> class T, size_t N>
+    static T<N>* make() { return glue::make<T<N>>(); }
+    template <typename T>
+    static void destroy(T* p) { glue::destroy(p); }
+};
+
+/**
+ * Pool of objects of sizes 24, 64, 200 and 720 (by slot % 4)
+ */
+template <template <size_t> class T, typename Alloc>
+struct pool {
+    void** slots;
+
+    void* make(size_t slot) {
+        void* p;
+        switch (slot & 3) {
+            case 0: p = Alloc::template make<T, 24>(); break;
+            case 1: p = Alloc::template make<T, 64>(); break;
+            case 2: p = Alloc::template make<T, 200>(); break;
+            default: p = Alloc::template make<T, 720>(); break;
+        }
+        // touch it like a constructor would
+        *static_cast<volatile char*>(p) = 1;
+        return p;
+    }
+
+    void destroy(size_t slot) {
+        void* p = slots[slot];
+        switch (slot & 3) {
+            case 0: Alloc::destroy(static_cast<T<24>*>(p)); break;
+            case 1: Alloc::destroy(static_cast<T<64>*>(p)); break;
+            case 2: Alloc::destroy(static_cast<T<200>*>(p)); break;
+            default: Alloc::destroy(static_cast<T<720>*>(p)); break;
+        }
+    }
+
+    /**
+     * Returns ns per replaced object
+     */
+    double run() {
+        slots = static_cast<void**>(calloc(opts.live, sizeof(void*)));
+        for (size_t i = 0; i < opts.live; i++) {
+            slots[i] = make(i);
+        }
+        uint64_t rng = 0x9e3779b97f4a7c15ull;
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < opts.ops; i++) {
+            size_t slot = bench_rand(&rng) % opts.live;
+            destroy(slot);
+            slots[slot] = make(slot);
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        for (size_t i = 0; i < opts.live; i++) {
+            destroy(i);
+        }
+        free(slots);
+        return (double)elapsed / (double)opts.ops;
+    }
+};
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -l N      live objects (default 10000)\n"
+            "  -n N      replaced objects (default 10M)\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "l:n:h")) != -1) {
+        switch (opt) {
+            case 'l': opts.live = bench_parse_size(optarg); break;
+            case 'n': opts.ops = bench_parse_size(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.live == 0 || opts.ops == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // warm up the heap so the first variant doesn't pay for it
+    pool<plain_obj, plain_new>().run();
+
+    double plain = pool<plain_obj, plain_new>().run();
+    double typed = pool<plain_obj, typed_new>().run();
+    double klass = pool<class_obj, plain_new>().run();
+
+    bench_header("typed");
+    bench_result("new_delete", plain, "ns/op");
+    bench_result("typed", typed, "ns/op");
+    bench_result("class_new", klass, "ns/op");
+    return bench_finish();
+}
@@ -0,0 +1,470 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+
+#include "bench-common.h"
+
+/**
+ * Synthetic macro-benchmarks modelling real allocation patterns
+ *
+ *   json    - build a JSON-like DOM (objects, arrays, strings) and tear it down
+ *   strcat  - grow strings piece by piece with realloc
+ *   hashmap - insert/erase churn on a chained hash map that rehashes
+ *   arena   - request-scoped pattern: many small objects freed together
+ *   lru     - long-lived cache with LRU eviction and mixed value sizes
+ *
+ * Every workload runs in its own forked child so RSS numbers
+ * aren't polluted by whatever ran before it.
+ */
+
+static struct {
+    unsigned seconds;
+    unsigned threads;
+    const char* only;
+} opts = {
+    .seconds = 2,
+    .threads = 1,
+    .only = NULL
+};
+
+static atomic_bool stop = false;
+
+// json
+
+enum node_type {
+    NODE_NUMBER,
+    NODE_STRING,
+    NODE_ARRAY,
+    NODE_OBJECT
+};
+
+typedef struct node {
+    enum node_type type;
+    size_t len;
+    size_t cap;
+    char** keys;         // objects only
+    struct node** items; // arrays and objects
+    char* str;
+    double num;
+} node;
+
+static char* random_string(uint64_t* rng, size_t min, size_t max) {
+    size_t len = bench_rand_size(rng, min, max);
+    char* s = malloc(len + 1);
+    for (size_t i = 0; i < len; i++) {
+        s[i] = (char)('a' + bench_rand(rng) % 26);
+    }
+    s[len] = '\0';
+    return s;
+}
+
+static void node_append(node* parent, char* key, node* child) {
+    // arrays grow like most parsers do it, doubling via realloc
+    if (parent->len == parent->cap) {
+        parent->cap = parent->cap ? parent->cap * 2 : 4;
+        parent->items = realloc(parent->items, parent->cap * sizeof(node*));
+        if (parent->type == NODE_OBJECT) {
+            parent->keys = realloc(parent->keys, parent->cap * sizeof(char*));
+        }
+    }
+    if (parent->type == NODE_OBJECT) {
+        parent->keys[parent->len] = key;
+    }
+    parent->items[parent->len++] = child;
+}
+
+static node* build_node(uint64_t* rng, unsigned depth) {
+    node* n = calloc(1, sizeof(node));
+    uint64_t r = bench_rand(rng) % 10;
+    if (depth == 0 || r < 4) {
+        if (r % 2) {
+            n->type = NODE_NUMBER;
+            n->num = (double)bench_rand(rng);
+        } else {
+            n->type = NODE_STRING;
+            n->str = random_string(rng, 1, 64);
+        }
+        return n;
+    }
+
+    n->type = r < 7 ? NODE_ARRAY : NODE_OBJECT;
+    size_t count = bench_rand_size(rng, 1, 16);
+    for (size_t i = 0; i < count; i++) {
+        char* key = n->type == NODE_OBJECT ? random_string(rng, 3, 16) : NULL;
+        node_append(n, key, build_node(rng, depth - 1));
+    }
+    return n;
+}
+
+static void free_node(node* n) {
+    for (size_t i = 0; i < n->len; i++) {
+        free_node(n->items[i]);
+        if (n->keys) {
+            free(n->keys[i]);
+        }
+    }
+    free(n->items);
+    free(n->keys);
+    free(n->str);
+    free(n);
+}
+
+static uint64_t run_json(uint64_t* rng) {
+    uint64_t docs = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        free_node(build_node(rng, 5));
+        docs++;
+    }
+    return docs;
+}
+
+// strcat
+
+static uint64_t run_strcat(uint64_t* rng) {
+    uint64_t appends = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        // grow a handful of strings at once so their blocks interleave
+        char* strs[8] = { NULL };
+        size_t lens[8] = { 0 };
+        size_t target = bench_rand_size(rng, 256, 256 << 10);
+        for (size_t total = 0; total < target; appends++) {
+            unsigned i = bench_rand(rng) % 8;
+            size_t piece = bench_rand_size(rng, 1, 80);
+            strs[i] = realloc(strs[i], lens[i] + piece + 1);
+            memset(strs[i] + lens[i], 'x', piece);
+            lens[i] += piece;
+            strs[i][lens[i]] = '\0';
+            total += piece;
+        }
+        for (unsigned i = 0; i < 8; i++) {
+            free(strs[i]);
+        }
+    }
+    return appends;
+}
+
+// hashmap
+
+typedef struct entry {
+    struct entry* next;
+    uint64_t hash;
+    char* key;
+    void* value;
+} entry;
+
+typedef struct hashmap {
+    entry** buckets;
+    size_t nbuckets;
+    size_t len;
+} hashmap;
+
+static uint64_t hash_key(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+static void hashmap_rehash(hashmap* map, size_t nbuckets) {
+    entry** buckets = calloc(nbuckets, sizeof(entry*));
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        for (entry* e = map->buckets[i]; e;) {
+            entry* next = e->next;
+            e->next = buckets[e->hash % nbuckets];
+            buckets[e->hash % nbuckets] = e;
+            e = next;
+        }
+    }
+    free(map->buckets);
+    map->buckets = buckets;
+    map->nbuckets = nbuckets;
+}
+
+static uint64_t run_hashmap(uint64_t* rng) {
+    const size_t keyspace = 1 << 18;
+    hashmap map = { NULL, 0, 0 };
+    hashmap_rehash(&map, 16);
+    uint64_t ops = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t key = bench_rand(rng) % keyspace;
+        uint64_t hash = hash_key(key);
+        entry** slot = &map.buckets[hash % map.nbuckets];
+        while (*slot && (*slot)->hash != hash) {
+            slot = &(*slot)->next;
+        }
+
+        if (*slot) {
+            // present -> erase
+            entry* e = *slot;
+            *slot = e->next;
+            free(e->key);
+            free(e->value);
+            free(e);
+            map.len--;
+        } else {
+            entry* e = malloc(sizeof(entry));
+            e->hash = hash;
+            e->key = random_string(rng, 8, 32);
+            e->value = malloc(bench_rand_size(rng, 8, 512));
+            e->next = map.buckets[hash % map.nbuckets];
+            map.buckets[hash % map.nbuckets] = e;
+            if (++map.len > map.nbuckets) {
+                hashmap_rehash(&map, map.nbuckets * 2);
+            }
+        }
+        ops++;
+    }
+
+    for (size_t i = 0; i < map.nbuckets; i++) {
+        for (entry* e = map.buckets[i]; e;) {
+            entry* next = e->next;
+            free(e->key);
+            free(e->value);
+            free(e);
+            e = next;
+        }
+    }
+    free(map.buckets);
+    return ops;
+}
+
+// arena
+
+static uint64_t run_arena(uint64_t* rng) {
+    uint64_t requests = 0;
+    size_t cap = 4096;
+    void** objs = malloc(cap * sizeof(void*));
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        // a request allocates a lot of small stuff and frees it all at the end
+        size_t count = bench_rand_size(rng, 100, cap);
+        for (size_t i = 0; i < count; i++) {
+            objs[i] = malloc(bench_rand_size(rng, 16, 256));
+            *(char*)objs[i] = 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            free(objs[i]);
+        }
+        requests++;
+    }
+    free(objs);
+    return requests;
+}
+
+// lru
+
+typedef struct lru_entry {
+    struct lru_entry* prev;
+    struct lru_entry* next;
+    uint64_t key;
+    void* value;
+} lru_entry;
+
+static uint64_t run_lru(uint64_t* rng) {
+    const size_t keyspace = 1 << 16;
+    const size_t capacity = 1 << 13;
+    lru_entry** index = calloc(keyspace, sizeof(lru_entry*));
+    lru_entry head = { &head, &head, 0, NULL };
+    size_t len = 0;
+    uint64_t lookups = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        // skewed key popularity, low keys are hot
+        uint64_t key = bench_rand_size(rng, 0, keyspace - 1);
+        lru_entry* e = index[key];
+        if (e) {
+            e->prev->next = e->next;
+            e->next->prev = e->prev;
+        } else {
+            if (len == capacity) {
+                lru_entry* victim = head.prev;
+                victim->prev->next = &head;
+                head.prev = victim->prev;
+                index[victim->key] = NULL;
+                free(victim->value);
+                free(victim);
+                len--;
+            }
+            e = malloc(sizeof(lru_entry));
+            e->key = key;
+            e->value = malloc(bench_rand_size(rng, 64, 16 << 10));
+            *(char*)e->value = 1;
+            index[key] = e;
+            len++;
+        }
+        e->next = head.next;
+        e->prev = &head;
+        head.next->prev = e;
+        head.next = e;
+        lookups++;
+    }
+
+    for (lru_entry* e = head.next; e != &head;) {
+        lru_entry* next = e->next;
+        free(e->value);
+        free(e);
+        e = next;
+    }
+    free(index);
+    return lookups;
+}
+
+typedef struct workload {
+    const char* name;
+    const char* unit;
+    uint64_t (*run)(uint64_t*);
+} workload;
+
+static const workload workloads[] = {
+    { "json", "docs/s", run_json },
+    { "strcat", "appends/s", run_strcat },
+    { "hashmap", "ops/s", run_hashmap },
+    { "arena", "requests/s", run_arena },
+    { "lru", "lookups/s", run_lru }
+};
+
+typedef struct thread_state {
+    pthread_t tid;
+    const workload* w;
+    uint64_t rng;
+    uint64_t ops;
+} thread_state;
+
+static void* worker(void* arg) {
+    thread_state* t = arg;
+    t->ops = t->w->run(&t->rng);
+    return NULL;
+}
+
+typedef struct child_result {
+    double throughput;
+    size_t peak_rss;
+    size_t end_rss;
+} child_result;
+
+/**
+ * Run a workload on all threads while tracking peak RSS
+ */
+static child_result run_workload(const workload* w) {
+    thread_state* threads = calloc(opts.threads, sizeof(thread_state));
+    size_t peak_rss = bench_rss_bytes();
+
+    uint64_t start = bench_now_ns();
+    for (unsigned i = 0; i < opts.threads; i++) {
+        threads[i].w = w;
+        threads[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&threads[i].tid, NULL, worker, &threads[i]);
+    }
+
+    uint64_t deadline = start + (uint64_t)opts.seconds * 1000000000ull;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = 10 * 1000000 };
+    while (bench_now_ns() < deadline) {
+        size_t rss = bench_rss_bytes();
+        if (rss > peak_rss) {
+            peak_rss = rss;
+        }
+        nanosleep(&interval, NULL);
+    }
+    atomic_store(&stop, true);
+
+    uint64_t ops = 0;
+    for (unsigned i = 0; i < opts.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        ops += threads[i].ops;
+    }
+    double elapsed = (double)(bench_now_ns() - start) / 1e9;
+    free(threads);
+
+    return (child_result){
+        .throughput = (double)ops / elapsed,
+        .peak_rss = peak_rss,
+        .end_rss = bench_rss_bytes()
+    };
+}
+
+/**
+ * Fork, run the workload in the child and read back its numbers
+ */
+static int run_isolated(const workload* w) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        child_result result = run_workload(w);
+        _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    child_result result;
+    ssize_t len = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (len != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: workload failed\n", w->name);
+        return 1;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s_throughput", w->name);
+    bench_result(name, result.throughput, w->unit);
+    snprintf(name, sizeof(name), "%s_peak_rss", w->name);
+    bench_result(name, (double)result.peak_rss / (1 << 20), "MiB");
+    snprintf(name, sizeof(name), "%s_end_rss", w->name);
+    bench_result(name, (double)result.end_rss / (1 << 20), "MiB");
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -w NAME   only run this workload (json, strcat, hashmap, arena, lru)\n"
+            "  -t N      threads running the workload (default 1)\n"
+            "  -d SEC    duration per workload (default 2)\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "w:t:d:h")) != -1) {
+        switch (opt) {
+            case 'w': opts.only = optarg; break;
+            case 't': opts.threads = (unsigned)atoi(optarg); break;
+            case 'd': opts.seconds = (unsigned)atoi(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.threads == 0 || opts.seconds == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bench_header("workloads");
+    int ret = 0;
+    bool found = false;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (opts.only && strcmp(opts.only, workloads[i].name) != 0) {
+            continue;
+        }
+        found = true;
+        ret |= run_isolated(&workloads[i]);
+    }
+    if (!found) {
+        usage(argv[0]);
+        return 1;
+    }
+    return ret | bench_finish();
+}
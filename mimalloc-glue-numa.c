@@ -0,0 +1,147 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#include "mimalloc-glue-numa.h"
+
+/**
+ * Read a small sysfs file into buf (NUL terminated)
+ */
+static ssize_t read_small(const char* path, char* buf, size_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t ret = read(fd, buf, len - 1);
+    close(fd);
+    buf[ret > 0 ? ret : 0] = '\0';
+    return ret;
+}
+
+static const char* parse_uint(const char* p, unsigned* out) {
+    if (*p < '0' || *p > '9') {
+        return NULL;
+    }
+    unsigned value = 0;
+    while (*p >= '0' && *p <= '9') {
+        value = value * 10 + (unsigned)(*p++ - '0');
+    }
+    *out = value;
+    return p;
+}
+
+bool numa_parse_cpulist(const char* list, numa_topology* topo, int node) {
+    const char* p = list;
+    while (*p && *p != '\n') {
+        unsigned first, last;
+        if (!(p = parse_uint(p, &first))) {
+            return false;
+        }
+        last = first;
+        if (*p == '-' && (!(p = parse_uint(p + 1, &last)) || last < first)) {
+            return false;
+        }
+        for (unsigned cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++) {
+            topo->cpu_node[cpu] = (int8_t)node;
+            topo->cpu_nodes |= 1u << node;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p && *p != '\n') {
+            return false;
+        }
+    }
+    if (node >= topo->nodes) {
+        topo->nodes = node + 1;
+    }
+    return true;
+}
+
+/**
+ * "N" -> split the online CPUs into N nodes of (almost) equal size
+ */
+static bool load_fake_count(numa_topology* topo, unsigned count) {
+    char buf[4096];
+    if (count == 0 || count > NUMA_MAX_NODES ||
+        read_small("/sys/devices/system/cpu/online", buf, sizeof(buf)) <= 0 ||
+        !numa_parse_cpulist(buf, topo, 0)) {
+        return false;
+    }
+
+    unsigned online = 0;
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS; cpu++) {
+        online += topo->cpu_node[cpu] == 0;
+    }
+    unsigned i = 0;
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS; cpu++) {
+        if (topo->cpu_node[cpu] == 0) {
+            int node = (int)(i++ * count / online);
+            topo->cpu_node[cpu] = (int8_t)node;
+            topo->cpu_nodes |= 1u << node;
+        }
+    }
+    topo->nodes = (int)count;
+    return true;
+}
+
+/**
+ * "0-3;4-7" -> cpulist per node
+ */
+static bool load_fake_lists(numa_topology* topo, const char* spec) {
+    char list[256];
+    int node = 0;
+    for (const char* p = spec; *p; node++) {
+        size_t len = strcspn(p, ";");
+        if (node >= NUMA_MAX_NODES || len >= sizeof(list)) {
+            return false;
+        }
+        memcpy(list, p, len);
+        list[len] = '\0';
+        if (!numa_parse_cpulist(list, topo, node)) {
+            return false;
+        }
+        p += len;
+        if (*p == ';') {
+            p++;
+        }
+    }
+    return node > 0;
+}
+
+bool numa_topology_load(numa_topology* topo, const char* fake) {
+    memset(topo->cpu_node, -1, sizeof(topo->cpu_node));
+    topo->nodes = 0;
+    topo->cpu_nodes = 0;
+    topo->fake = fake != NULL;
+
+    if (fake) {
+        unsigned count;
+        const char* end = parse_uint(fake, &count);
+        if (end && *end == '\0') {
+            return load_fake_count(topo, count);
+        }
+        return load_fake_lists(topo, fake);
+    }
+
+    // node ids can have holes, look at all of them
+    char path[64];
+    char buf[4096];
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_small(path, buf, sizeof(buf)) < 0) {
+            continue;
+        }
+        if (!numa_parse_cpulist(buf, topo, node)) {
+            return false;
+        }
+    }
+    return topo->cpu_nodes != 0;
+}
+
+int numa_bind_memory(void* addr, size_t len, int node) {
+    unsigned long mask = 1ul << node;
+    return (int)syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
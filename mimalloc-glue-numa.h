@@ -0,0 +1,79 @@
+#ifndef MIMALLOC_GLUE_NUMA_H
+#define MIMALLOC_GLUE_NUMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * NUMA topology for the glue's NUMA mode (MALLOC_GLUE_NUMA=1)
+ *
+ * Maps CPUs to nodes, read from /sys/devices/system/node or made up
+ * so the mode can be exercised on single-node machines:
+ *
+ *   MALLOC_GLUE_NUMA_FAKE=2            online CPUs split into 2 nodes
+ *   MALLOC_GLUE_NUMA_FAKE="0-3;4-7"    one cpulist per node
+ *
+ * Nothing in here allocates, the glue runs it during init().
+ */
+
+#define NUMA_MAX_NODES 32
+#define NUMA_MAX_CPUS 4096
+
+typedef struct numa_topology {
+    // highest node id + 1
+    int nodes;
+    // nodes that have at least one CPU
+    uint32_t cpu_nodes;
+    // made up, memory can't be bound to these nodes
+    bool fake;
+    // -1 for CPUs we don't know about
+    int8_t cpu_node[NUMA_MAX_CPUS];
+} numa_topology;
+
+// internal to the glue, don't export these from the .so
+#pragma GCC visibility push(hidden)
+
+/**
+ * Parse a kernel style cpulist ("0-3,8,10-11") and
+ * assign all CPUs in it to node
+ * Returns false on syntax errors
+ */
+bool numa_parse_cpulist(const char* list, numa_topology* topo, int node);
+
+/**
+ * Fill topo from a fake spec (see above) or sysfs if fake is NULL
+ * Returns false if there's nothing usable
+ */
+bool numa_topology_load(numa_topology* topo, const char* fake);
+
+/**
+ * Prefer node for the pages in [addr, addr + len)
+ * Returns 0 or -1 with errno set
+ */
+int numa_bind_memory(void* addr, size_t len, int node);
+
+#pragma GCC visibility pop
+
+/**
+ * glibc >= 2.35 registers rseq for every thread and the kernel
+ * keeps the current CPU in there, so checking for migrations
+ * is a plain load instead of a getcpu() call
+ */
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+static inline bool numa_have_rseq(void) {
+    return &__rseq_size && __rseq_size > 0;
+}
+
+/**
+ * CPU the calling thread runs on (only valid if numa_have_rseq())
+ */
+static inline int numa_rseq_cpu(void) {
+    // struct rseq { uint32_t cpu_id_start; uint32_t cpu_id; ... }
+    const volatile uint32_t* rseq = (const volatile uint32_t*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    return (int)rseq[1];
+}
+
+#endif // MIMALLOC_GLUE_NUMA_H
@@ -0,0 +1,365 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mimalloc-glue-policy.h"
+
+static const char* match_names[POLICY_MATCH_COUNT] = {
+    "exe",
+    "comm",
+    "cgroup"
+};
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/**
+ * Split off the next whitespace separated token
+ * Returns NULL at the end of the line or at a comment
+ */
+static char* next_token(char** cursor) {
+    char* p = *cursor;
+    while (is_space(*p)) {
+        p++;
+    }
+    if (*p == '\0' || *p == '#') {
+        *cursor = p;
+        return NULL;
+    }
+    char* token = p;
+    while (*p && !is_space(*p)) {
+        p++;
+    }
+    if (*p) {
+        *p++ = '\0';
+    }
+    *cursor = p;
+    return token;
+}
+
+int policy_parse_line(char* line, policy_rule* rule, const char** error) {
+    char* cursor = line;
+    char* kind = next_token(&cursor);
+    if (!kind) {
+        return 0;
+    }
+
+    rule->settings.backend = NULL;
+    rule->settings.profile = NULL;
+    rule->settings.stats = -1;
+
+    int match = -1;
+    for (int i = 0; i < POLICY_MATCH_COUNT; i++) {
+        if (strcmp(kind, match_names[i]) == 0) {
+            match = i;
+        }
+    }
+    if (match < 0) {
+        *error = "expected exe, comm or cgroup";
+        return -1;
+    }
+    rule->match = (enum policy_match)match;
+
+    char* pattern = next_token(&cursor);
+    if (!pattern) {
+        *error = "missing pattern";
+        return -1;
+    }
+    rule->pattern = pattern;
+    rule->pattern_len = strlen(pattern);
+    rule->prefix = pattern[rule->pattern_len - 1] == '*';
+    if (rule->prefix) {
+        rule->pattern_len--;
+    }
+
+    for (char* setting; (setting = next_token(&cursor));) {
+        char* value = strchr(setting, '=');
+        if (!value || value == setting || value[1] == '\0') {
+            *error = "expected key=value";
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcmp(setting, "backend") == 0) {
+            rule->settings.backend = value;
+        } else if (strcmp(setting, "profile") == 0) {
+            rule->settings.profile = value;
+        } else if (strcmp(setting, "stats") == 0) {
+            if ((value[0] != '0' && value[0] != '1') || value[1] != '\0') {
+                *error = "stats must be 0 or 1";
+                return -1;
+            }
+            rule->settings.stats = value[0] - '0';
+        } else {
+            *error = "unknown key (expected backend, profile or stats)";
+            return -1;
+        }
+    }
+    return 1;
+}
+
+uint32_t policy_hash(enum policy_match match, const char* str, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (uint8_t)match) * 16777619u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Read a small /proc file into buf (NUL terminated)
+ */
+static ssize_t read_small(const char* path, char* buf, size_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t ret = read(fd, buf, len - 1);
+    close(fd);
+    buf[ret > 0 ? ret : 0] = '\0';
+    return ret;
+}
+
+static void load_attr(policy_process* proc, enum policy_match match) {
+    char* attr = proc->attrs[match];
+    size_t size = sizeof(proc->attrs[match]);
+    attr[0] = '\0';
+
+    switch (match) {
+        case POLICY_MATCH_EXE: {
+            ssize_t len = readlink("/proc/self/exe", attr, size - 1);
+            attr[len > 0 ? len : 0] = '\0';
+            break;
+        }
+        case POLICY_MATCH_COMM: {
+            if (read_small("/proc/self/comm", attr, size) > 0) {
+                attr[strcspn(attr, "\n")] = '\0';
+            }
+            break;
+        }
+        case POLICY_MATCH_CGROUP: {
+            // cgroup v2 is the "0::<path>" line
+            // with only v1 mounted use the path of the first hierarchy
+            char buf[4096];
+            if (read_small("/proc/self/cgroup", buf, sizeof(buf)) <= 0) {
+                break;
+            }
+            const char* path = NULL;
+            for (char* line = buf; line && *line;) {
+                char* end = strchr(line, '\n');
+                if (end) {
+                    *end = '\0';
+                }
+                char* sep = strchr(line, ':');
+                sep = sep ? strchr(sep + 1, ':') : NULL;
+                if (sep && (!path || strncmp(line, "0::", 3) == 0)) {
+                    path = sep + 1;
+                }
+                line = end ? end + 1 : NULL;
+            }
+            if (path) {
+                size_t len = strlen(path);
+                if (len < size) {
+                    memcpy(attr, path, len + 1);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+const char* policy_process_get(policy_process* proc, enum policy_match match) {
+    if (!(proc->loaded & (1u << match))) {
+        load_attr(proc, match);
+        proc->loaded |= 1u << match;
+    }
+    return proc->attrs[match][0] ? proc->attrs[match] : NULL;
+}
+
+bool policy_rule_matches(const policy_rule* rule, policy_process* proc) {
+    const char* attr = policy_process_get(proc, rule->match);
+    if (!attr) {
+        return false;
+    }
+    if (rule->prefix) {
+        return strncmp(attr, rule->pattern, rule->pattern_len) == 0;
+    }
+    return strlen(attr) == rule->pattern_len && memcmp(attr, rule->pattern, rule->pattern_len) == 0;
+}
+
+bool policy_lookup_text(const char* path, char* buf, size_t len, policy_process* proc, policy_settings* out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    size_t used = 0;
+    ssize_t ret;
+    while (used < len - 1 && (ret = read(fd, buf + used, len - 1 - used)) > 0) {
+        used += (size_t)ret;
+    }
+    close(fd);
+    buf[used] = '\0';
+
+    for (char* line = buf; line && *line;) {
+        char* end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        } else if (used == len - 1) {
+            // cut off in the middle of a line, don't guess
+            break;
+        }
+
+        policy_rule rule;
+        const char* error;
+        if (policy_parse_line(line, &rule, &error) == 1 && policy_rule_matches(&rule, proc)) {
+            *out = rule.settings;
+            return true;
+        }
+        line = end ? end + 1 : NULL;
+    }
+    return false;
+}
+
+/**
+ * Pointers into the sections of a cache
+ */
+typedef struct cache_view {
+    const policy_cache_header* header;
+    const uint32_t* buckets;
+    const policy_cache_rule* rules;
+    const uint32_t* slow;
+    const char* strtab;
+} cache_view;
+
+static bool cache_map(const void* cache, size_t len, cache_view* view) {
+    if (len < sizeof(policy_cache_header)) {
+        return false;
+    }
+    const policy_cache_header* header = cache;
+    if (header->magic != POLICY_CACHE_MAGIC || header->version != POLICY_CACHE_VERSION) {
+        return false;
+    }
+    // bucket count is a power of two (or zero)
+    if (header->nbuckets & (header->nbuckets - 1)) {
+        return false;
+    }
+    size_t expected = sizeof(policy_cache_header)
+        + (size_t)header->nbuckets * sizeof(uint32_t)
+        + (size_t)header->nrules * sizeof(policy_cache_rule)
+        + (size_t)header->nslow * sizeof(uint32_t)
+        + header->strtab_size;
+    if (expected != len || header->strtab_size == 0) {
+        return false;
+    }
+
+    const char* base = cache;
+    view->header = header;
+    view->buckets = (const uint32_t*)(base + sizeof(policy_cache_header));
+    view->rules = (const policy_cache_rule*)(view->buckets + header->nbuckets);
+    view->slow = (const uint32_t*)(view->rules + header->nrules);
+    view->strtab = (const char*)(view->slow + header->nslow);
+    return view->strtab[header->strtab_size - 1] == '\0';
+}
+
+static bool valid_index(const cache_view* view, uint32_t index) {
+    return index == POLICY_NONE || index < view->header->nrules;
+}
+
+static bool valid_string(const cache_view* view, uint32_t offset) {
+    return offset == POLICY_NONE || offset < view->header->strtab_size;
+}
+
+bool policy_cache_valid(const void* cache, size_t len, uint64_t ino, uint64_t size, int64_t mtime_sec, int64_t mtime_nsec) {
+    cache_view view;
+    if (!cache_map(cache, len, &view)) {
+        return false;
+    }
+    const policy_cache_header* header = view.header;
+    if (header->src_ino != ino || header->src_size != size ||
+        header->src_mtime_sec != mtime_sec || header->src_mtime_nsec != mtime_nsec) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->nbuckets; i++) {
+        if (!valid_index(&view, view.buckets[i])) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->nrules; i++) {
+        const policy_cache_rule* rule = &view.rules[i];
+        if (!valid_index(&view, rule->next) || rule->match >= POLICY_MATCH_COUNT ||
+            rule->pattern >= header->strtab_size || rule->pattern_len > header->strtab_size - rule->pattern ||
+            !valid_string(&view, rule->backend) || !valid_string(&view, rule->profile)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->nslow; i++) {
+        if (view.slow[i] >= header->nrules) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void cache_rule(const cache_view* view, uint32_t index, policy_rule* out) {
+    const policy_cache_rule* rule = &view->rules[index];
+    out->match = (enum policy_match)rule->match;
+    out->prefix = rule->prefix;
+    out->pattern = view->strtab + rule->pattern;
+    out->pattern_len = rule->pattern_len;
+    out->settings.backend = rule->backend == POLICY_NONE ? NULL : view->strtab + rule->backend;
+    out->settings.profile = rule->profile == POLICY_NONE ? NULL : view->strtab + rule->profile;
+    out->settings.stats = rule->stats;
+}
+
+bool policy_lookup_cache(const void* cache, size_t len, policy_process* proc, policy_settings* out) {
+    cache_view view;
+    if (!cache_map(cache, len, &view)) {
+        return false;
+    }
+    const policy_cache_header* header = view.header;
+    uint32_t best = POLICY_NONE;
+    policy_rule rule;
+
+    // exact rules, chains are in rule order so the first hit is the earliest
+    if (header->nbuckets) {
+        for (int match = POLICY_MATCH_EXE; match <= POLICY_MATCH_COMM; match++) {
+            const char* attr = policy_process_get(proc, (enum policy_match)match);
+            if (!attr) {
+                continue;
+            }
+            uint32_t hash = policy_hash((enum policy_match)match, attr, strlen(attr));
+            uint32_t index = view.buckets[hash & (header->nbuckets - 1)];
+            // bounded walk, the cache is only checked for sane indices not for loops
+            for (uint32_t steps = 0; index != POLICY_NONE && index < best && steps < header->nrules; steps++) {
+                cache_rule(&view, index, &rule);
+                if ((int)rule.match == match && !rule.prefix && policy_rule_matches(&rule, proc)) {
+                    best = index;
+                    break;
+                }
+                index = view.rules[index].next;
+            }
+        }
+    }
+
+    // everything else, only worth checking if it would come first
+    for (uint32_t i = 0; i < header->nslow && view.slow[i] < best; i++) {
+        cache_rule(&view, view.slow[i], &rule);
+        if (policy_rule_matches(&rule, proc)) {
+            best = view.slow[i];
+            break;
+        }
+    }
+
+    if (best == POLICY_NONE) {
+        return false;
+    }
+    cache_rule(&view, best, &rule);
+    *out = rule.settings;
+    return true;
+}
@@ -0,0 +1,151 @@
+#ifndef MIMALLOC_GLUE_POLICY_H
+#define MIMALLOC_GLUE_POLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Per-executable policy for system-wide deployment
+ * (shared by the glue and tools/malloc-glue-policy.c)
+ *
+ * The config file has one rule per line, first matching rule wins:
+ *
+ *   # <exe|comm|cgroup> <pattern> <key>=<value>...
+ *   exe    /usr/bin/make                  backend=skip
+ *   comm   postgres                       profile=memory
+ *   cgroup /system.slice/redis.service    backend=libjemalloc.so.2 stats=1
+ *   exe    /opt/bin/lowlat-*              profile=latency
+ *
+ * A pattern ending in '*' matches by prefix, "*" alone matches everything.
+ * Keys: backend (library to dlopen, "libc" or "skip"), profile, stats.
+ *
+ * Parsing the text file is linear in the number of rules so
+ * `malloc-glue-policy compile` turns it into <config>.cache:
+ * exact exe/comm rules go into a hash table and only prefix and cgroup
+ * rules are still checked one by one. The glue uses the cache
+ * as long as it matches the config file's inode, size and mtime.
+ *
+ * Nothing in here allocates, the glue runs it before malloc works.
+ */
+
+#define POLICY_DEFAULT_PATH "/etc/malloc-glue.conf"
+#define POLICY_CACHE_SUFFIX ".cache"
+
+// biggest text config the glue reads without a cache
+#define POLICY_MAX_TEXT (64 * 1024)
+
+enum policy_match {
+    POLICY_MATCH_EXE,
+    POLICY_MATCH_COMM,
+    POLICY_MATCH_CGROUP,
+    POLICY_MATCH_COUNT
+};
+
+/**
+ * What a rule selects
+ * NULL / -1 means "not set by this rule"
+ */
+typedef struct policy_settings {
+    const char* backend;
+    const char* profile;
+    int stats;
+} policy_settings;
+
+typedef struct policy_rule {
+    enum policy_match match;
+    // pattern ended in '*', match by prefix
+    bool prefix;
+    const char* pattern;
+    size_t pattern_len;
+    policy_settings settings;
+} policy_rule;
+
+/**
+ * Identity of the current process
+ * attributes are read from /proc the first time a rule needs them
+ */
+typedef struct policy_process {
+    unsigned loaded;
+    char attrs[POLICY_MATCH_COUNT][256];
+} policy_process;
+
+/**
+ * On-disk cache layout
+ * header, buckets, rules, slow rule indices, string table
+ */
+#define POLICY_CACHE_MAGIC 0x4350474du // "MGPC"
+#define POLICY_CACHE_VERSION 1
+#define POLICY_NONE UINT32_MAX
+
+typedef struct policy_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    // identity of the config file this was built from
+    uint64_t src_ino;
+    uint64_t src_size;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint32_t nrules;
+    uint32_t nbuckets;
+    uint32_t nslow;
+    uint32_t strtab_size;
+} policy_cache_header;
+
+typedef struct policy_cache_rule {
+    uint32_t pattern;
+    uint32_t pattern_len;
+    uint32_t backend;
+    uint32_t profile;
+    // next rule in the same hash bucket (ascending rule order)
+    uint32_t next;
+    uint8_t match;
+    uint8_t prefix;
+    int8_t stats;
+    uint8_t pad;
+} policy_cache_rule;
+
+// internal to the glue, don't export these from the .so
+#pragma GCC visibility push(hidden)
+
+/**
+ * Parse one line in place (NUL terminates the strings it points to)
+ * Returns 1 for a rule, 0 for blank/comment lines and -1 on errors
+ * with *error describing the problem
+ */
+int policy_parse_line(char* line, policy_rule* rule, const char** error);
+
+/**
+ * Hash used for the cache buckets
+ */
+uint32_t policy_hash(enum policy_match match, const char* str, size_t len);
+
+/**
+ * Get an attribute of the process, NULL if it can't be determined
+ */
+const char* policy_process_get(policy_process* proc, enum policy_match match);
+
+bool policy_rule_matches(const policy_rule* rule, policy_process* proc);
+
+/**
+ * Find the settings for this process in a text config
+ * buf (of size len) must outlive the returned settings
+ * Returns true if a rule matched
+ */
+bool policy_lookup_text(const char* path, char* buf, size_t len, policy_process* proc, policy_settings* out);
+
+/**
+ * Same for a mapped cache
+ * Returns true if a rule matched
+ */
+bool policy_lookup_cache(const void* cache, size_t len, policy_process* proc, policy_settings* out);
+
+/**
+ * Check that a cache is well formed and was built from
+ * the config described by the stat fields
+ */
+bool policy_cache_valid(const void* cache, size_t len, uint64_t ino, uint64_t size, int64_t mtime_sec, int64_t mtime_nsec);
+
+#pragma GCC visibility pop
+
+#endif // MIMALLOC_GLUE_POLICY_H
@@ -0,0 +1,190 @@
+#ifndef MIMALLOC_GLUE_PTRSET_H
+#define MIMALLOC_GLUE_PTRSET_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Pointer set
+ *
+ * Fixed size open addressing (linear probing) hash set of pointers
+ * that the glue has to route somewhere other than the LUT.
+ * Never allocates, lives in a header so free() can inline lookups
+ * and tests/ can poke at it.
+ *
+ * Lookups are lock free. Inserts and removes take the set's lock,
+ * removes shift the following entries back into the hole instead of
+ * leaving tombstones so probe chains don't grow with churn.
+ * Entries only ever move backwards during a remove which bumps seq
+ * around it, a lookup that missed while seq changed tries again.
+ */
+#define PTRSET_EMPTY ((uintptr_t)0)
+
+typedef struct ptrset {
+    atomic_uintptr_t* slots;
+    size_t mask;
+    // serialises inserts and removes
+    pthread_mutex_t lock;
+    // odd while a remove moves entries around
+    atomic_uint seq;
+    // live entries, lets callers skip lookups while empty
+    atomic_size_t live;
+    // address range ever inserted, a cheap filter for lookups
+    atomic_uintptr_t lo;
+    atomic_uintptr_t hi;
+} ptrset;
+
+// slots has to be an array with a power of two size
+#define PTRSET_INIT(slots) \
+    { (slots), sizeof(slots) / sizeof((slots)[0]) - 1, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 }
+
+static inline size_t ptrset_hash(const ptrset* set, uintptr_t key) {
+    return (size_t)(((key >> 4) * 0x9e3779b97f4a7c15ull) >> 20) & set->mask;
+}
+
+/**
+ * Slot index of key or -1, caller holds the lock
+ */
+static inline ptrdiff_t ptrset_index_locked(ptrset* set, uintptr_t key) {
+    size_t i = ptrset_hash(set, key);
+    for (size_t probes = 0; probes <= set->mask; probes++, i = (i + 1) & set->mask) {
+        uintptr_t cur = atomic_load_explicit(&set->slots[i], memory_order_relaxed);
+        if (cur == key) {
+            return (ptrdiff_t)i;
+        }
+        if (cur == PTRSET_EMPTY) {
+            break;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Callers that have to do more than one change at a time
+ * take the lock and use the _locked variants
+ */
+static inline void ptrset_lock(ptrset* set) {
+    pthread_mutex_lock(&set->lock);
+}
+
+static inline void ptrset_unlock(ptrset* set) {
+    pthread_mutex_unlock(&set->lock);
+}
+
+static inline bool ptrset_insert_locked(ptrset* set, void* ptr) {
+    uintptr_t key = (uintptr_t)ptr;
+    // keep one slot empty, removes and misses stop there
+    if (atomic_load_explicit(&set->live, memory_order_relaxed) >= set->mask) {
+        return false;
+    }
+    size_t i = ptrset_hash(set, key);
+    for (size_t probes = 0; probes <= set->mask; probes++, i = (i + 1) & set->mask) {
+        uintptr_t cur = atomic_load_explicit(&set->slots[i], memory_order_relaxed);
+        if (cur == key) {
+            return false;
+        }
+        if (cur == PTRSET_EMPTY) {
+            // lo/hi first, a lookup that finds the key must get past the filter
+            if (!atomic_load_explicit(&set->lo, memory_order_relaxed) ||
+                key < atomic_load_explicit(&set->lo, memory_order_relaxed)) {
+                atomic_store_explicit(&set->lo, key, memory_order_relaxed);
+            }
+            if (key > atomic_load_explicit(&set->hi, memory_order_relaxed)) {
+                atomic_store_explicit(&set->hi, key, memory_order_relaxed);
+            }
+            atomic_fetch_add_explicit(&set->live, 1, memory_order_relaxed);
+            atomic_store_explicit(&set->slots[i], key, memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Empty slot i and move later entries of the chain into the hole
+ */
+static inline void ptrset_erase_locked(ptrset* set, size_t i) {
+    atomic_store_explicit(&set->seq, atomic_load_explicit(&set->seq, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (size_t j = (i + 1) & set->mask;; j = (j + 1) & set->mask) {
+        uintptr_t cur = atomic_load_explicit(&set->slots[j], memory_order_relaxed);
+        if (cur == PTRSET_EMPTY) {
+            break;
+        }
+        // cur may fill the hole unless its home lies in (i, j]
+        size_t home = ptrset_hash(set, cur);
+        if (((j - home) & set->mask) >= ((j - i) & set->mask)) {
+            atomic_store_explicit(&set->slots[i], cur, memory_order_relaxed);
+            i = j;
+        }
+    }
+    atomic_store_explicit(&set->slots[i], PTRSET_EMPTY, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&set->live, 1, memory_order_relaxed);
+    atomic_store_explicit(&set->seq, atomic_load_explicit(&set->seq, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+/**
+ * Add ptr, false if the set is full or ptr is in it already
+ */
+static inline bool ptrset_insert(ptrset* set, void* ptr) {
+    ptrset_lock(set);
+    bool ret = ptrset_insert_locked(set, ptr);
+    ptrset_unlock(set);
+    return ret;
+}
+
+static inline bool ptrset_contains(ptrset* set, const void* ptr) {
+    uintptr_t key = (uintptr_t)ptr;
+    if (atomic_load_explicit(&set->live, memory_order_relaxed) == 0 ||
+        key < atomic_load_explicit(&set->lo, memory_order_relaxed) ||
+        key > atomic_load_explicit(&set->hi, memory_order_relaxed)) {
+        return false;
+    }
+    for (;;) {
+        unsigned seq = atomic_load_explicit(&set->seq, memory_order_acquire);
+        size_t i = ptrset_hash(set, key);
+        for (size_t probes = 0; probes <= set->mask; probes++, i = (i + 1) & set->mask) {
+            uintptr_t cur = atomic_load_explicit(&set->slots[i], memory_order_acquire);
+            if (cur == key) {
+                return true;
+            }
+            if (cur == PTRSET_EMPTY) {
+                break;
+            }
+        }
+        // a miss only counts if nothing moved meanwhile
+        atomic_thread_fence(memory_order_acquire);
+        if (!(seq & 1) && atomic_load_explicit(&set->seq, memory_order_relaxed) == seq) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Remove ptr, true if it was in the set
+ */
+static inline bool ptrset_remove_locked(ptrset* set, const void* ptr) {
+    ptrdiff_t i = ptrset_index_locked(set, (uintptr_t)ptr);
+    if (i < 0) {
+        return false;
+    }
+    ptrset_erase_locked(set, (size_t)i);
+    return true;
+}
+
+static inline bool ptrset_remove(ptrset* set, const void* ptr) {
+    if (!ptrset_contains(set, ptr)) {
+        return false;
+    }
+    ptrset_lock(set);
+    bool ret = ptrset_remove_locked(set, ptr);
+    ptrset_unlock(set);
+    return ret;
+}
+
+#endif // MIMALLOC_GLUE_PTRSET_H
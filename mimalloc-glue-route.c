@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mimalloc-glue-route.h"
+
+const char* const route_names[ROUTE_COUNT] = {
+    "backend",
+    "thp",
+    "large",
+    "pool",
+    "colour"
+};
+
+size_t parse_size(const char* str, char** end) {
+    size_t size = strtoull(str, end, 0);
+    switch (**end) {
+        case 'g': case 'G': size <<= 10; // fall through
+        case 'm': case 'M': size <<= 10; // fall through
+        case 'k': case 'K': size <<= 10; (*end)++; break;
+        default: break;
+    }
+    return size;
+}
+
+bool route_add(route_table* table, enum route target, size_t size, size_t alignment) {
+    if (table->count == ROUTE_MAX) {
+        return false;
+    }
+    route_entry* entries = table->entries;
+    unsigned i = table->count++;
+    while (i > 0 && (entries[i - 1].alignment < alignment ||
+                     (entries[i - 1].alignment == alignment && entries[i - 1].size < size))) {
+        entries[i] = entries[i - 1];
+        i--;
+    }
+    entries[i] = (route_entry){ size, alignment, target };
+    if (alignment && alignment < table->min_align) {
+        table->min_align = alignment;
+    } else if (!alignment && size < table->min) {
+        table->min = size;
+    }
+    return true;
+}
+
+const char* route_parse(route_table* table, const char* spec) {
+    for (const char* p = spec; *p;) {
+        size_t len = strcspn(p, ":");
+        enum route target = ROUTE_COUNT;
+        for (int i = 0; i < ROUTE_COUNT; i++) {
+            if (strlen(route_names[i]) == len && strncmp(p, route_names[i], len) == 0) {
+                target = (enum route)i;
+            }
+        }
+        if (target == ROUTE_COUNT || p[len] != ':') {
+            return p;
+        }
+        char* end;
+        size_t size = parse_size(p + len + 1, &end);
+        size_t alignment = 0;
+        if (*end == '/') {
+            alignment = parse_size(end + 1, &end);
+        }
+        // the backend route only makes sense to punch holes, e.g.
+        // backend:1G above large:64M
+        if ((*end != ',' && *end != '\0') || !route_add(table, target, size, alignment)) {
+            return p;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return NULL;
+}
+
+enum route route_lookup(const route_table* table, size_t size, size_t alignment) {
+    for (unsigned i = 0; i < table->count; i++) {
+        if (size >= table->entries[i].size && alignment >= table->entries[i].alignment) {
+            return table->entries[i].target;
+        }
+    }
+    return ROUTE_BACKEND;
+}
@@ -0,0 +1,99 @@
+#ifndef MIMALLOC_GLUE_ROUTE_H
+#define MIMALLOC_GLUE_ROUTE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Size based routing (MALLOC_GLUE_ROUTE)
+ *
+ * Which allocator serves a request is looked up by its size and,
+ * for the aligned calls, its alignment:
+ *   backend  the backend as always
+ *   thp      the backend with transparent huge pages (see thp_wanted())
+ *   large    a mapping of its own (see large_alloc())
+ *   pool     recycled page aligned buffers (see pool_alloc())
+ *   colour   the backend, cache colouring the start (see colour_alloc())
+ *
+ *   MALLOC_GLUE_ROUTE="thp:2M,large:256M,large:64K/4K"
+ *
+ * An entry takes requests of at least its size (and alignment after
+ * the '/', only the aligned calls ask for one). The entry with the
+ * biggest alignment, then the biggest size wins.
+ * MALLOC_GLUE_THP, MALLOC_GLUE_LARGE(_ALIGN), MALLOC_GLUE_POOL and
+ * MALLOC_GLUE_COLOUR add entries too.
+ *
+ * Unaligned requests below the smallest entry without alignment go
+ * straight to the backend, that's a single compare. Frees and
+ * reallocs find the owner by the pointer, not the route.
+ *
+ * Nothing in here allocates, the glue fills the table during init().
+ */
+enum route {
+    ROUTE_BACKEND,
+    ROUTE_THP,
+    ROUTE_LARGE,
+    ROUTE_POOL,
+    ROUTE_COLOUR,
+    ROUTE_COUNT
+};
+
+#define ROUTE_MAX 8
+
+typedef struct route_entry {
+    size_t size;
+    size_t alignment;
+    enum route target;
+} route_entry;
+
+typedef struct route_table {
+    // sorted by alignment, then size (descending)
+    route_entry entries[ROUTE_MAX];
+    unsigned count;
+    // smallest request that can leave the backend
+    // and smallest alignment that can if it's smaller than that
+    size_t min;
+    size_t min_align;
+} route_table;
+
+#define ROUTE_TABLE_INIT { { { 0, 0, ROUTE_BACKEND } }, 0, SIZE_MAX, SIZE_MAX }
+
+// internal to the glue, don't export these from the .so
+#pragma GCC visibility push(hidden)
+
+extern const char* const route_names[ROUTE_COUNT];
+
+/**
+ * Parse a size with optional K/M/G suffix, end points behind it
+ */
+size_t parse_size(const char* str, char** end);
+
+/**
+ * Add an entry, false if the table is full
+ */
+bool route_add(route_table* table, enum route target, size_t size, size_t alignment);
+
+/**
+ * Add the entries of a "target:size[/alignment],..." spec
+ * Returns NULL or the entry it couldn't parse or add,
+ * the ones before that are in the table
+ */
+const char* route_parse(route_table* table, const char* spec);
+
+/**
+ * Target of the first entry taking the request
+ */
+enum route route_lookup(const route_table* table, size_t size, size_t alignment);
+
+#pragma GCC visibility pop
+
+static inline enum route route_for(const route_table* table, size_t size, size_t alignment) {
+    // alignment is a constant 0 in the unaligned wrappers
+    if (__builtin_expect(size < table->min && (alignment == 0 || alignment < table->min_align), 1)) {
+        return ROUTE_BACKEND;
+    }
+    return route_lookup(table, size, alignment);
+}
+
+#endif // MIMALLOC_GLUE_ROUTE_H
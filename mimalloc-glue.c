@@ -2,9 +2,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
 #include <errno.h>
+#include <limits.h>
 #define __USE_GNU // PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/auxv.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+
+#include "mimalloc-glue.h"
+#include "mimalloc-glue-policy.h"
+#include "mimalloc-glue-numa.h"
+#include "mimalloc-glue-ptrset.h"
+#include "mimalloc-glue-route.h"
 
 // _Nullable is a clang extension
 #if !defined(__clang__)
@@ -38,7 +55,6 @@ typedef struct malloc_lut {
     char* (*realpath)(const char*, char*);
 
     // Various Posix and Unix variants
-    void* (*reallocf)(void*, size_t);
     size_t (*malloc_size)(void*);
     size_t (*malloc_usable_size)(void *_Nullable);
     size_t (*malloc_good_size)(size_t);
@@ -77,161 +93,1349 @@ static malloc_lut lut = {
     NULL,
     NULL,
     NULL,
-    NULL,
     NULL
 };
 
 static void* libc_so = NULL;
-static void* libmimalloc_so = NULL;
+static void* backend_so = NULL;
 
 /**
- * Resolve a function named symbol
- * If RTLD_NEXT is from libc return custom
- * else return whatever it is
+ * Optional extension symbols of the backend
+ * (not part of the malloc interface so they may be NULL)
  */
-static void* resolve_func(const char* symbol) {
-    // try to get a handle for existing libc
-    if (!libc_so) {
-        libc_so = dlopen("libc.so.6", RTLD_LAZY | RTLD_NOLOAD);
-        if (!libc_so) {
-            fprintf(stderr, "libc.so.6 not loaded\n");
-            abort();
-        }
+typedef struct backend_ext {
+    void (*process_info)(size_t*, size_t*, size_t*, size_t*, size_t*, size_t*, size_t*, size_t*);
+    void (*collect)(bool);
+    int (*version)(void);
+    void (*option_set)(int, long);
+    // mi_arena_id_t is an int up to mimalloc 2.x
+    bool (*manage_os_memory_ex)(void*, size_t, bool, bool, bool, int, bool, int*);
+    void* (*heap_new_in_arena)(int);
+    void* (*heap_set_default)(void*);
+    int (*reserve_huge_os_pages_interleave)(size_t, size_t, size_t);
+    long (*option_get)(int);
+    void* (*heap_new)(void);
+    void (*heap_destroy)(void*);
+    bool (*heap_contains_block)(void*, const void*);
+    void (*heap_delete)(void*);
+    void* (*heap_malloc)(void*, size_t);
+    void* (*heap_malloc_aligned)(void*, size_t, size_t);
+    void (*free_size_aligned)(void*, size_t, size_t);
+    void* (*malloc_small)(size_t);
+    void* (*expand)(void*, size_t);
+} backend_ext;
+
+static backend_ext ext = {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+// size of a transparent huge page (x86-64 and most arm64 configs)
+#define HUGE_PAGE_SIZE (2ul << 20)
+
+// base page size, see large_alloc()
+static size_t large_page = 4096;
+// large blocks are aligned to at least this + 1
+// (less than a page with cache colouring)
+static size_t large_mask = 4095;
+
+/**
+ * Runtime configuration
+ * read from MALLOC_GLUE_* environment variables in init()
+ */
+typedef struct glue_config {
+    // library to dlopen() as backend
+    // "libc" uses whatever is next in search order
+    const char* backend;
+
+    // like "libc" but also turns off everything else the glue does
+    bool skip;
+
+    // run the backend's collect before fork()
+    // so children share fewer dirty pages
+    bool prefork_collect;
+
+    // name of the backend option profile to apply
+    const char* profile;
+
+    // count calls going through the wrappers
+    // and print them on exit
+    bool stats;
+
+    // serve allocations from libc until the process
+    // made lazy_allocs allocations, lazy_bytes bytes or lived lazy_ms
+    bool lazy;
+    size_t lazy_allocs;
+    size_t lazy_bytes;
+    size_t lazy_ms;
+
+    // per-node arenas and heaps bound to the node the thread runs on
+    bool numa;
+    // made up topology (see mimalloc-glue-numa.h)
+    const char* numa_fake;
+    // address space reserved per node
+    size_t numa_reserve;
+
+    // explicit huge pages reserved for the backend at init
+    // bytes of 2 MiB pages and number of 1 GiB pages
+    size_t huge_2m;
+    size_t huge_1g;
+    // 2 MiB align allocations of at least thp_min bytes
+    // and ask for transparent huge pages for them
+    bool thp;
+    size_t thp_min;
+
+    // arena reserved and faulted in at init
+    size_t prewarm;
+    // fault it in from a background thread instead of during init
+    bool prewarm_async;
+    // mlock() it as well
+    bool prewarm_mlock;
+
+    // background thread purging and collecting for the application
+    bool maint;
+    size_t maint_ms;
+    // collect everything once nothing happened for this long
+    size_t maint_idle_ms;
+    // calls per second above which the thread stays out of the way
+    size_t maint_busy;
+    // backend purge delay, SIZE_MAX keeps the backend's default
+    size_t maint_purge_ms;
+
+    // watch cgroup limits and PSI from the maintenance thread
+    bool pressure;
+    // cgroup directory and PSI file to watch (NULL: our own / system wide)
+    const char* pressure_cgroup;
+    const char* pressure_psi;
+    // usage of memory.max (percent) and PSI "some avg10"
+    // at which the levels start
+    unsigned pressure_limits[3];
+    unsigned pressure_psi_limits[3];
+
+    // free() inside malloc_glue_scope_begin()/end() really frees
+    // scoped blocks, otherwise they wait for the end of the scope
+    bool scope_free;
+
+    // blocks of at least this size get a mapping of their own
+    // and grow with mremap() (0: off)
+    size_t large;
+    // same for aligned requests of at least this alignment
+    size_t large_align;
+
+    // bytes of page aligned buffers kept for reuse (0: off)
+    size_t pool;
+
+    // malloc()/calloc() blocks of at least this size get faulted in
+    // by a background thread, chunk bytes at a time (0: off)
+    size_t prefault;
+    size_t prefault_chunk;
+} glue_config;
+
+static glue_config config = {
+    "libmimalloc.so",
+    false,
+    false,
+    NULL,
+    false,
+    false,
+    1024,
+    4 << 20,
+    50,
+    false,
+    NULL,
+    1ul << 30,
+    0,
+    0,
+    false,
+    2 << 20,
+    0,
+    false,
+    false,
+    false,
+    100,
+    1000,
+    1000000,
+    SIZE_MAX,
+    false,
+    NULL,
+    NULL,
+    { 80, 90, 95 },
+    { 10, 25, 50 },
+    true,
+    0,
+    0,
+    0,
+    0,
+    2 << 20
+};
+
+// call counters are on (see count_alloc())
+static bool counting = false;
+
+/**
+ * Read one of our environment variables
+ * Nothing in secure mode (setuid, setgid, file capabilities) so whoever
+ * starts a privileged program can't pick its config file, backend or
+ * knobs, only the system policy file applies there.
+ * getenv() doesn't allocate so this is safe during init
+ */
+static bool secure_mode = false;
+
+static const char* getenv_str(const char* name) {
+    return secure_mode ? NULL : getenv(name);
+}
+
+/**
+ * Read a boolean environment variable
+ */
+static bool getenv_bool(const char* name, bool def) {
+    const char* value = getenv_str(name);
+    if (!value || !*value) {
+        return def;
+    }
+    return !(value[0] == '0' || value[0] == 'n' || value[0] == 'N' || value[0] == 'f' || value[0] == 'F');
+}
+
+/**
+ * Read a size environment variable with optional K/M/G suffix
+ */
+static size_t getenv_size(const char* name, size_t def) {
+    const char* value = getenv_str(name);
+    if (!value || !*value) {
+        return def;
     }
+    char* end;
+    return parse_size(value, &end);
+}
 
-    // try to load and get a handle for libmimalloc
-    if (!libmimalloc_so) {
-        libmimalloc_so = dlopen("libmimalloc.so", RTLD_LAZY | RTLD_LOCAL);
-        if (!libmimalloc_so) {
-            fprintf(stderr, "Failed to load libmimalloc.so\n");
-            abort();
+/**
+ * Read "a,b,c" into levels (ascending), keeps the defaults on errors
+ */
+static void getenv_levels(const char* name, unsigned levels[3]) {
+    const char* value = getenv_str(name);
+    if (!value || !*value) {
+        return;
+    }
+    unsigned parsed[3];
+    char* end = (char*)value;
+    for (int i = 0; i < 3; i++) {
+        parsed[i] = (unsigned)strtoul(end, &end, 10);
+        if ((i < 2 && *end != ',') || (i > 0 && parsed[i] < parsed[i - 1])) {
+            fprintf(stderr, "malloc-glue: %s should be three ascending numbers like 80,90,95\n", name);
+            return;
         }
+        end++;
     }
+    memcpy(levels, parsed, sizeof(parsed));
+}
 
-    // address of the symbol in libc
-    void* libc_sym = dlsym(libc_so, symbol);
-#ifndef NDEBUG
-    if (libc_sym) {
-        fprintf(stderr, "%s() found in libc: %p\n", symbol, libc_sym);
-    } else {
-        fprintf(stderr, "%s() not found in libc\n", symbol);
+/**
+ * Read a small (/proc or /sys) file into buf (NUL terminated)
+ */
+static ssize_t read_file(const char* path, char* buf, size_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
     }
-#endif
+    ssize_t ret = read(fd, buf, len - 1);
+    close(fd);
+    buf[ret > 0 ? ret : 0] = '\0';
+    return ret;
+}
 
-    // address of the symbol in mimalloc
-    void* libmimalloc_sym = dlsym(libmimalloc_so, symbol);
-#ifndef NDEBUG
-    if (libmimalloc_sym) {
-        fprintf(stderr, "%s() found in libmimalloc: %p\n", symbol, libmimalloc_sym);
-    } else {
-        fprintf(stderr, "%s() not found in libmimalloc\n", symbol);
+/**
+ * Text of the policy file if there is no usable cache
+ * the selected settings point into this (or the mapped cache)
+ */
+static char policy_text[POLICY_MAX_TEXT];
+static policy_process policy_proc;
+
+/**
+ * Find the policy rule for this process
+ * (see mimalloc-glue-policy.h)
+ * Prefers the compiled cache if it's up to date
+ */
+static bool load_policy(policy_settings* out) {
+    const char* path = getenv_str("MALLOC_GLUE_CONFIG");
+    if (!path) {
+        path = POLICY_DEFAULT_PATH;
+    }
+    // empty -> explicitly disabled
+    if (!*path) {
+        return false;
     }
-#endif
 
-    // address of the next (in search order) symbol
-    void* next_sym = dlsym(RTLD_NEXT, symbol);
-#ifndef NDEBUG
-    if (next_sym) {
-        fprintf(stderr, "%s() next in search order: %p\n", symbol, next_sym);
-    } else {
-        fprintf(stderr, "%s() not in any loaded object\n", symbol);
+    struct stat src;
+    if (stat(path, &src) != 0) {
+        return false;
     }
-#endif
 
-    // if next is NULL we don't want to map it here either
-    if (!next_sym) {
+    char cache_path[4096];
+    size_t len = strlen(path);
+    if (len + sizeof(POLICY_CACHE_SUFFIX) <= sizeof(cache_path)) {
+        memcpy(cache_path, path, len);
+        memcpy(cache_path + len, POLICY_CACHE_SUFFIX, sizeof(POLICY_CACHE_SUFFIX));
+
+        int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* cache = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            fd = -1;
+            if (cache != MAP_FAILED) {
+                if (policy_cache_valid(cache, (size_t)st.st_size, (uint64_t)src.st_ino, (uint64_t)src.st_size,
+                                       (int64_t)src.st_mtim.tv_sec, (int64_t)src.st_mtim.tv_nsec)) {
+                    // keep it mapped if a rule matched, settings point into it
+                    bool found = policy_lookup_cache(cache, (size_t)st.st_size, &policy_proc, out);
+                    if (!found) {
+                        munmap(cache, (size_t)st.st_size);
+                    }
+                    return found;
+                }
 #ifndef NDEBUG
-        fprintf(stderr, "%s() leaving undefined\n", symbol);
+                fprintf(stderr, "%s is stale, reading %s\n", cache_path, path);
 #endif
-        return NULL;
+                munmap(cache, (size_t)st.st_size);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
     }
 
-    // if next is either libc default or mimalloc select it
-    if (next_sym == libc_sym || next_sym == libmimalloc_sym) {
-#ifndef NDEBUG
-        fprintf(stderr, "%s() selected from mimalloc: %p\n", symbol, libmimalloc_sym);
-#endif
-        return libmimalloc_sym;
+    return policy_lookup_text(path, policy_text, sizeof(policy_text), &policy_proc, out);
+}
+
+/**
+ * Size based routing, see mimalloc-glue-route.h
+ */
+static route_table routes = ROUTE_TABLE_INIT;
+
+// cache line size, the unit cache colouring moves blocks by
+#define COLOUR_LINE 64
+// large blocks of these sizes get coloured (MALLOC_GLUE_COLOUR)
+static size_t large_colour_min = SIZE_MAX;
+static size_t large_colour_max = SIZE_MAX;
+
+static void add_route(enum route target, size_t size, size_t alignment) {
+    if (!route_add(&routes, target, size, alignment)) {
+        fprintf(stderr, "malloc-glue: more than %d routes, ignoring %s:%zu\n", ROUTE_MAX, route_names[target], size);
     }
+}
 
-    // if not that means another library already claimed the symbol
-    // use that version then
+/**
+ * Fill config from the policy file and the environment
+ * Environment variables win over the policy file
+ */
+static void load_config(void) {
+    secure_mode = getauxval(AT_SECURE) != 0;
+    policy_settings policy = { NULL, NULL, -1 };
+    if (load_policy(&policy)) {
 #ifndef NDEBUG
-    fprintf(stderr, "%s() selected from search path: %p\n", symbol, next_sym);
+        fprintf(stderr, "Policy: backend=%s profile=%s stats=%d\n",
+                policy.backend ? policy.backend : "-", policy.profile ? policy.profile : "-", policy.stats);
 #endif
-    return next_sym;
-}
+    }
 
-static pthread_mutex_t mutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
-static bool initialized = false;
+    // even a soname would let the caller load any system library
+    // (and run its constructors), secure mode only takes the policy's
+    const char* backend = getenv_str("MALLOC_GLUE_BACKEND");
+    if (backend && *backend) {
+        config.backend = backend;
+    } else if (policy.backend) {
+        config.backend = policy.backend;
+    }
+    if (strcmp(config.backend, "skip") == 0) {
+        config.skip = true;
+        config.backend = "libc";
+        return;
+    }
+
+    config.prefork_collect = getenv_bool("MALLOC_GLUE_PREFORK_COLLECT", false);
+    config.profile = getenv_str("MALLOC_GLUE_PROFILE");
+    if (!config.profile) {
+        config.profile = policy.profile;
+    }
+    config.stats = getenv_bool("MALLOC_GLUE_STATS", policy.stats > 0);
+
+    config.lazy = getenv_bool("MALLOC_GLUE_LAZY", false);
+    config.lazy_allocs = getenv_size("MALLOC_GLUE_LAZY_ALLOCS", config.lazy_allocs);
+    config.lazy_bytes = getenv_size("MALLOC_GLUE_LAZY_BYTES", config.lazy_bytes);
+    config.lazy_ms = getenv_size("MALLOC_GLUE_LAZY_MS", config.lazy_ms);
+
+    config.numa = getenv_bool("MALLOC_GLUE_NUMA", false);
+    config.numa_fake = getenv_str("MALLOC_GLUE_NUMA_FAKE");
+    if (config.numa_fake && !*config.numa_fake) {
+        config.numa_fake = NULL;
+    }
+    config.numa_reserve = getenv_size("MALLOC_GLUE_NUMA_RESERVE", config.numa_reserve);
+
+    config.huge_2m = getenv_size("MALLOC_GLUE_HUGE_2M", config.huge_2m);
+    config.huge_1g = getenv_size("MALLOC_GLUE_HUGE_1G", config.huge_1g);
+    config.thp = getenv_bool("MALLOC_GLUE_THP", false);
+    config.thp_min = getenv_size("MALLOC_GLUE_THP_MIN", config.thp_min);
+    if (config.thp_min < HUGE_PAGE_SIZE) {
+        config.thp_min = HUGE_PAGE_SIZE;
+    }
+
+    config.prewarm = getenv_size("MALLOC_GLUE_PREWARM", config.prewarm);
+    config.prewarm_async = getenv_bool("MALLOC_GLUE_PREWARM_ASYNC", false);
+    config.prewarm_mlock = getenv_bool("MALLOC_GLUE_PREWARM_MLOCK", false);
+
+    config.maint = getenv_bool("MALLOC_GLUE_MAINT", false);
+    config.maint_ms = getenv_size("MALLOC_GLUE_MAINT_MS", config.maint_ms);
+    if (config.maint_ms == 0) {
+        config.maint_ms = 1;
+    }
+    config.maint_idle_ms = getenv_size("MALLOC_GLUE_MAINT_IDLE_MS", config.maint_idle_ms);
+    config.maint_busy = getenv_size("MALLOC_GLUE_MAINT_BUSY", config.maint_busy);
+    config.maint_purge_ms = getenv_size("MALLOC_GLUE_MAINT_PURGE_MS", config.maint_purge_ms);
+
+    config.pressure = getenv_bool("MALLOC_GLUE_PRESSURE", false);
+    config.pressure_cgroup = getenv_str("MALLOC_GLUE_PRESSURE_CGROUP");
+    config.pressure_psi = getenv_str("MALLOC_GLUE_PRESSURE_PSI");
+    getenv_levels("MALLOC_GLUE_PRESSURE_LIMITS", config.pressure_limits);
+    getenv_levels("MALLOC_GLUE_PRESSURE_PSI_LIMITS", config.pressure_psi_limits);
+
+    config.scope_free = getenv_bool("MALLOC_GLUE_SCOPE_FREE", config.scope_free);
+
+    config.large = getenv_size("MALLOC_GLUE_LARGE", config.large);
+    large_page = (size_t)sysconf(_SC_PAGESIZE);
+    large_mask = large_page - 1;
+
+    if (config.thp) {
+        add_route(ROUTE_THP, config.thp_min, 0);
+    }
+    if (config.large) {
+        add_route(ROUTE_LARGE, config.large, 0);
+    }
+    config.large_align = getenv_size("MALLOC_GLUE_LARGE_ALIGN", config.large_align);
+    if (config.large_align) {
+        add_route(ROUTE_LARGE, 0, config.large_align);
+    }
+    const char* colour = getenv_str("MALLOC_GLUE_COLOUR");
+    if (colour && *colour) {
+        // MIN[-MAX], above MAX whatever was routed there before,
+        // backend blocks in between get coloured and large blocks
+        // stay large, coloured in their mapping
+        char* end;
+        size_t min = parse_size(colour, &end);
+        size_t max = SIZE_MAX;
+        if (*end == '-') {
+            max = parse_size(end + 1, &end);
+            add_route(route_lookup(&routes, max, 0), max, 0);
+        }
+        if (route_lookup(&routes, min, 0) != ROUTE_LARGE) {
+            add_route(ROUTE_COLOUR, min, 0);
+        }
+        large_colour_min = min;
+        large_colour_max = max;
+        // coloured large blocks start anywhere in their first page
+        large_mask = COLOUR_LINE - 1;
+    }
+    config.prefault = getenv_size("MALLOC_GLUE_PREFAULT", config.prefault);
+    config.prefault_chunk = getenv_size("MALLOC_GLUE_PREFAULT_CHUNK", config.prefault_chunk);
+    if (config.prefault_chunk < large_page) {
+        config.prefault_chunk = large_page;
+    }
+
+    config.pool = getenv_size("MALLOC_GLUE_POOL", config.pool);
+    if (config.pool) {
+        // any size, sub-page buffers get a whole page
+        add_route(ROUTE_POOL, 0, large_page);
+    }
+    const char* route = getenv_str("MALLOC_GLUE_ROUTE");
+    const char* bad = route ? route_parse(&routes, route) : NULL;
+    if (bad) {
+        if (routes.count == ROUTE_MAX) {
+            fprintf(stderr, "malloc-glue: more than %d routes, ignoring \"%s\"\n", ROUTE_MAX, bad);
+        } else {
+            fprintf(stderr, "malloc-glue: bad MALLOC_GLUE_ROUTE entry at \"%s\"\n", bad);
+        }
+    }
+    // what the routes need
+    for (unsigned i = 0; i < routes.count; i++) {
+        switch (routes.entries[i].target) {
+            case ROUTE_THP:
+                config.thp = true;
+                break;
+            case ROUTE_POOL:
+                // a pool route without MALLOC_GLUE_POOL
+                if (!config.pool) {
+                    config.pool = 64 << 20;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+
+    // the maintenance thread goes by the call counters
+    counting = config.stats || config.maint;
+}
 
 /**
- * Initialisation to call on load.
- * This initially sets a default "real" malloc interface
- * for following dlopen() calls to work.
- * Once we have working malloc we load our custom malloc shared object
- * and replace all symbols with their equivalent version from it.
+ * Backend option profiles
  *
- * This can't use __attribute__((constructor)) because we can't predict
- * the order in which the dynamic linker calls these init hooks
+ * Option numbers are mi_option_t values as of mimalloc 1.8/2.1
+ * (they get renumbered between releases so apply_profile() checks
+ * mi_version() before touching anything).
+ * Sizes (arena_reserve) are in KiB like mimalloc uses internally.
  */
-static void init(void) {
-    if (initialized) {
+#define MI_OPTION_EAGER_COMMIT 3
+#define MI_OPTION_ARENA_EAGER_COMMIT 4
+#define MI_OPTION_PURGE_DECOMMITS 5
+#define MI_OPTION_ALLOW_LARGE_OS_PAGES 6
+#define MI_OPTION_ABANDONED_PAGE_PURGE 12
+#define MI_OPTION_PURGE_DELAY 15
+#define MI_OPTION_ARENA_RESERVE 23
+#define MI_OPTION_ARENA_PURGE_MULT 24
+
+typedef struct profile_option {
+    int option;
+    // MIMALLOC_* variable that overrides the profile
+    const char* env;
+    long value;
+} profile_option;
+
+typedef struct profile {
+    const char* name;
+    profile_option options[8];
+} profile;
+
+static const profile profiles[] = {
+    // keep memory around, avoid commit/purge work
+    { "throughput", {
+        { MI_OPTION_EAGER_COMMIT, "MIMALLOC_EAGER_COMMIT", 1 },
+        { MI_OPTION_ARENA_EAGER_COMMIT, "MIMALLOC_ARENA_EAGER_COMMIT", 1 },
+        { MI_OPTION_ALLOW_LARGE_OS_PAGES, "MIMALLOC_ALLOW_LARGE_OS_PAGES", 1 },
+        { MI_OPTION_PURGE_DELAY, "MIMALLOC_PURGE_DELAY", 250 },
+        { MI_OPTION_ARENA_RESERVE, "MIMALLOC_ARENA_RESERVE", 4l << 20 },
+        { 0, NULL, 0 }
+    } },
+    // never purge so nobody pays for decommit or refaulting inline
+    { "latency", {
+        { MI_OPTION_EAGER_COMMIT, "MIMALLOC_EAGER_COMMIT", 1 },
+        { MI_OPTION_ARENA_EAGER_COMMIT, "MIMALLOC_ARENA_EAGER_COMMIT", 1 },
+        { MI_OPTION_PURGE_DELAY, "MIMALLOC_PURGE_DELAY", -1 },
+        { MI_OPTION_ABANDONED_PAGE_PURGE, "MIMALLOC_ABANDONED_PAGE_PURGE", 0 },
+        { MI_OPTION_ARENA_RESERVE, "MIMALLOC_ARENA_RESERVE", 1l << 20 },
+        { 0, NULL, 0 }
+    } },
+    // give memory back as soon as possible
+    { "memory", {
+        { MI_OPTION_EAGER_COMMIT, "MIMALLOC_EAGER_COMMIT", 0 },
+        { MI_OPTION_ARENA_EAGER_COMMIT, "MIMALLOC_ARENA_EAGER_COMMIT", 0 },
+        { MI_OPTION_ALLOW_LARGE_OS_PAGES, "MIMALLOC_ALLOW_LARGE_OS_PAGES", 0 },
+        { MI_OPTION_PURGE_DECOMMITS, "MIMALLOC_PURGE_DECOMMITS", 1 },
+        { MI_OPTION_PURGE_DELAY, "MIMALLOC_PURGE_DELAY", 0 },
+        { MI_OPTION_ARENA_PURGE_MULT, "MIMALLOC_ARENA_PURGE_MULT", 1 },
+        { MI_OPTION_ABANDONED_PAGE_PURGE, "MIMALLOC_ABANDONED_PAGE_PURGE", 1 },
+        { MI_OPTION_ARENA_RESERVE, "MIMALLOC_ARENA_RESERVE", 64l << 10 }
+    } }
+};
+
+/**
+ * Whether mi_option_set() takes the option numbers above
+ */
+static bool options_supported(int version) {
+    return ext.option_set && ((version >= 180 && version < 200) || (version >= 210 && version < 300));
+}
+
+/**
+ * Apply config.profile through mi_option_set()
+ * Options the user set explicitly via MIMALLOC_* are left alone
+ */
+static void apply_profile(void) {
+    if (!config.profile || !*config.profile) {
         return;
     }
 
-    // EDEADLK -> we are the initialising thread
-    // all expected and good... I think
-    // ... we *should* have the temporary init malloc
-    if (pthread_mutex_lock(&mutex) == EDEADLK) {
+    const profile* selected = NULL;
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+        if (strcmp(profiles[i].name, config.profile) == 0) {
+            selected = &profiles[i];
+            break;
+        }
+    }
+    if (!selected) {
+        fprintf(stderr, "malloc-glue: unknown profile '%s'\n", config.profile);
         return;
     }
 
-    // catch potential threads that waited for init to complete
-    if (initialized) {
-        pthread_mutex_unlock(&mutex);
+    int version = ext.version ? ext.version() : 0;
+    if (!options_supported(version)) {
+        fprintf(stderr, "malloc-glue: backend doesn't support profiles (version %d)\n", version);
         return;
     }
 
+    for (size_t i = 0; i < sizeof(selected->options) / sizeof(selected->options[0]); i++) {
+        const profile_option* opt = &selected->options[i];
+        if (!opt->env) {
+            break;
+        }
+        if (getenv(opt->env)) {
 #ifndef NDEBUG
-    fprintf(stderr, "Starting initialisation\n");
+            fprintf(stderr, "%s set, ignoring profile value\n", opt->env);
+#endif
+            continue;
+        }
+#ifndef NDEBUG
+        fprintf(stderr, "Profile %s: option %d = %ld\n", selected->name, opt->option, opt->value);
 #endif
+        ext.option_set(opt->option, opt->value);
+    }
+}
 
-    // temporarily set defaults for resolve_func() to work
-    lut.malloc = dlsym(RTLD_NEXT, "malloc");
-    lut.calloc = dlsym(RTLD_NEXT, "calloc");
-    lut.realloc = dlsym(RTLD_NEXT, "realloc");
-    lut.free = dlsym(RTLD_NEXT, "free");
-    lut.strdup = dlsym(RTLD_NEXT, "strdup");
-    lut.strndup = dlsym(RTLD_NEXT, "strndup");
-    lut.realpath = dlsym(RTLD_NEXT, "realpath");
-    lut.reallocf = dlsym(RTLD_NEXT, "reallocf");
-    lut.malloc_size = dlsym(RTLD_NEXT, "malloc_size");
-    lut.malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
-    lut.malloc_good_size = dlsym(RTLD_NEXT, "malloc_good_size");
-    lut.cfree = dlsym(RTLD_NEXT, "cfree");
-    lut.valloc = dlsym(RTLD_NEXT, "valloc");
-    lut.pvalloc = dlsym(RTLD_NEXT, "pvalloc");
-    lut.reallocarray = dlsym(RTLD_NEXT, "reallocarray");
-    lut.reallocarr = dlsym(RTLD_NEXT, "reallocarr");
-    lut.memalign = dlsym(RTLD_NEXT, "memalign");
-    lut.aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
-    lut.posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
-    lut._posix_memalign = dlsym(RTLD_NEXT, "_posix_memalign");
+/**
+ * Short name of the backend for malloc_glue_backend()
+ * "libmimalloc.so.2" -> "mimalloc"
+ */
+static char backend_name[64] = "libc";
+
+static void set_backend_name(const char* library) {
+    const char* name = strrchr(library, '/');
+    name = name ? name + 1 : library;
+    if (strncmp(name, "lib", 3) == 0) {
+        name += 3;
+    }
+    size_t len = strcspn(name, ".");
+    if (len == 0 || len >= sizeof(backend_name)) {
+        return;
+    }
+    memcpy(backend_name, name, len);
+    backend_name[len] = '\0';
+}
+
+/**
+ * Backend side of the maintenance thread (see maint_thread())
+ * purge delay explicitly set via MIMALLOC_PURGE_DELAY wins
+ */
+static void maint_setup(void) {
+    if (!config.maint || config.maint_purge_ms == SIZE_MAX || getenv("MIMALLOC_PURGE_DELAY")) {
+        return;
+    }
+    if (!options_supported(ext.version ? ext.version() : 0)) {
+        fprintf(stderr, "malloc-glue: can't set the backend's purge delay\n");
+        return;
+    }
+    ext.option_set(MI_OPTION_PURGE_DELAY, (long)config.maint_purge_ms);
+}
+
+/**
+ * Map size bytes of anonymous memory aligned to ARENA_ALIGN
+ * (mimalloc wants arenas aligned to its segment size)
+ * flags are added to the final mapping, e.g. MAP_HUGETLB
+ */
+#define ARENA_ALIGN (32ul << 20)
+
+static void* map_arena(size_t size, int flags) {
+    // placeholder to find an aligned spot, replaced by the real mapping
+    size_t span = size + ARENA_ALIGN;
+    char* area = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        return NULL;
+    }
+    char* start = (char*)(((uintptr_t)area + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1));
+    if (mmap(start, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | flags, -1, 0) == MAP_FAILED) {
+        munmap(area, span);
+        return NULL;
+    }
+    if (start > area) {
+        munmap(area, (size_t)(start - area));
+    }
+    munmap(start + size, (size_t)(area + span - (start + size)));
+    return start;
+}
+
+/**
+ * Explicit huge pages (MALLOC_GLUE_HUGE_2M / MALLOC_GLUE_HUGE_1G)
+ *
+ * 1 GiB pages go through mimalloc's own reservation, 2 MiB pages are
+ * mapped from the hugetlb pool here and handed over as an arena.
+ * Both need pages in the pool (vm.nr_hugepages or hugepages= at boot).
+ */
+static void huge_setup(void) {
+    if (config.huge_1g) {
+        if (!ext.reserve_huge_os_pages_interleave) {
+            fprintf(stderr, "malloc-glue: backend can't reserve 1 GiB pages\n");
+        } else if (ext.reserve_huge_os_pages_interleave(config.huge_1g, 0, config.huge_1g * 500) != 0) {
+            fprintf(stderr, "malloc-glue: failed to reserve %zu 1 GiB pages\n", config.huge_1g);
+        }
+    }
 
+    if (config.huge_2m) {
+        size_t size = (config.huge_2m + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+        if (!ext.manage_os_memory_ex) {
+            fprintf(stderr, "malloc-glue: backend can't use 2 MiB pages\n");
+            return;
+        }
+        void* start = map_arena(size, MAP_HUGETLB | (21 << MAP_HUGE_SHIFT));
+        if (!start) {
+            fprintf(stderr, "malloc-glue: failed to map %zu bytes of 2 MiB pages\n", size);
+            return;
+        }
+        int arena;
+        if (!ext.manage_os_memory_ex(start, size, true, true, true, -1, false, &arena)) {
+            fprintf(stderr, "malloc-glue: backend refused the 2 MiB page arena\n");
+            munmap(start, size);
+            return;
+        }
 #ifndef NDEBUG
-    fprintf(stderr, "Temporary malloc set\n");
+        fprintf(stderr, "2 MiB pages: arena %d, %zu bytes at %p\n", arena, size, start);
 #endif
+    }
+}
 
-    // now resolve
-    void* malloc = resolve_func("malloc");
-    void* calloc = resolve_func("calloc");
-    void* realloc = resolve_func("realloc");
-    void* free = resolve_func("free");
-    void* strdup = resolve_func("strdup");
-    void* strndup = resolve_func("strndup");
+/**
+ * Prewarm (MALLOC_GLUE_PREWARM=SIZE)
+ *
+ * Reserves SIZE bytes as a backend arena at init and faults all of it
+ * in, so the first requests of a service don't pay for page faults.
+ * MALLOC_GLUE_PREWARM_ASYNC=1 does the faulting in a background thread
+ * started once the glue is loaded instead of delaying startup.
+ * MALLOC_GLUE_PREWARM_MLOCK=1 keeps the arena resident, the backend
+ * treats it as pinned then and never purges it.
+ */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static char* prewarm_area = NULL;
+static size_t prewarm_size = 0;
+static atomic_bool prewarm_pending = false;
+
+static void prewarm_populate(void) {
+    // Linux >= 5.14, otherwise touch every page ourselves
+    // (the backend may already hand this memory out, so don't change it)
+    if (madvise(prewarm_area, prewarm_size, MADV_POPULATE_WRITE) != 0) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < prewarm_size; offset += page) {
+            __atomic_fetch_or(prewarm_area + offset, 0, __ATOMIC_RELAXED);
+        }
+    }
+    if (config.prewarm_mlock && mlock(prewarm_area, prewarm_size) != 0) {
+        fprintf(stderr, "malloc-glue: failed to mlock prewarmed memory: %s\n", strerror(errno));
+    }
+#ifndef NDEBUG
+    fprintf(stderr, "Prewarmed %zu bytes at %p\n", prewarm_size, prewarm_area);
+#endif
+}
+
+static void prewarm_setup(void) {
+    if (!config.prewarm) {
+        return;
+    }
+    if (!ext.manage_os_memory_ex) {
+        fprintf(stderr, "malloc-glue: backend doesn't support prewarming\n");
+        return;
+    }
+    size_t size = (config.prewarm + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    char* area = map_arena(size, 0);
+    if (!area) {
+        fprintf(stderr, "malloc-glue: failed to reserve %zu bytes to prewarm\n", size);
+        return;
+    }
+    int arena;
+    if (!ext.manage_os_memory_ex(area, size, true, config.prewarm_mlock, true, -1, false, &arena)) {
+        fprintf(stderr, "malloc-glue: backend refused the prewarm arena\n");
+        munmap(area, size);
+        return;
+    }
+    prewarm_area = area;
+    prewarm_size = size;
+
+    // the lazy switch can happen anywhere, don't start threads from there
+    if (config.prewarm_async && !config.lazy) {
+        atomic_store(&prewarm_pending, true);
+    } else {
+        prewarm_populate();
+    }
+}
+
+static void* prewarm_thread(void* arg) {
+    (void)arg;
+    prewarm_populate();
+    return NULL;
+}
+
+/**
+ * Transparent huge pages for large allocations (MALLOC_GLUE_THP=1)
+ *
+ * The wrappers 2 MiB align allocations of at least thp_min bytes
+ * (or whatever the thp route says) and madvise() the huge page sized
+ * part of them, smaller ones are left to the system wide THP setting.
+ */
+static inline bool thp_wanted(size_t size) {
+    return route_for(&routes, size, 0) == ROUTE_THP;
+}
+
+static void thp_advise(void* ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    uintptr_t start = ((uintptr_t)ptr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~(HUGE_PAGE_SIZE - 1);
+    if (end > start) {
+        madvise((void*)start, end - start, MADV_HUGEPAGE);
+    }
+}
+
+static void* thp_malloc(size_t size) {
+    void* ret = lut.aligned_alloc(HUGE_PAGE_SIZE, size);
+    thp_advise(ret, size);
+    return ret;
+}
+
+/**
+ * Bytes of this process backed by huge pages (THP and hugetlb)
+ * from /proc/self/smaps_rollup
+ */
+static size_t huge_backed_bytes(void) {
+    char buf[4096];
+    if (read_file("/proc/self/smaps_rollup", buf, sizeof(buf)) <= 0) {
+        return MALLOC_GLUE_UNKNOWN;
+    }
+
+    static const char* fields[] = { "AnonHugePages:", "Shared_Hugetlb:", "Private_Hugetlb:" };
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        const char* field = strstr(buf, fields[i]);
+        if (field) {
+            total += strtoull(field + strlen(fields[i]), NULL, 10) * 1024;
+        }
+    }
+    return total;
+}
+
+/**
+ * Scoped heaps (malloc_glue_scope_begin()/end())
+ *
+ * begin() makes a new backend heap the thread's default heap, so every
+ * allocation of the thread lands in it until end() puts the previous
+ * heap back and destroys the scoped one with everything still in it.
+ * Scopes nest up to SCOPE_MAX_DEPTH deep.
+ * With MALLOC_GLUE_SCOPE_FREE=0 free() skips blocks of the thread's
+ * open scopes, they're released all at once by end().
+ */
+#define SCOPE_MAX_DEPTH 16
+
+static __thread unsigned tls_scope_depth __attribute__((tls_model("initial-exec")));
+static __thread void* tls_scope_heaps[SCOPE_MAX_DEPTH];
+static __thread void* tls_scope_prev[SCOPE_MAX_DEPTH];
+
+/**
+ * free() can skip ptr, end() will take care of it
+ * ptr has to be a backend block, the heap lookup reads its segment
+ * (large, pool and coloured blocks are checked before this)
+ */
+static inline bool scope_owned(void* ptr) {
+    if (!tls_scope_depth || config.scope_free || !ptr) {
+        return false;
+    }
+    for (unsigned i = tls_scope_depth; i > 0; i--) {
+        if (ext.heap_contains_block(tls_scope_heaps[i - 1], ptr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Async prefault (MALLOC_GLUE_PREFAULT=SIZE)
+ *
+ * malloc() and calloc() blocks of at least SIZE are handed to a
+ * background thread that faults them in with MADV_POPULATE_WRITE,
+ * front to back in MALLOC_GLUE_PREFAULT_CHUNK pieces (2 MiB), so
+ * a thread filling a fresh 1 GiB buffer mostly finds its pages
+ * there already. Only page tables change, never the contents.
+ *
+ * free() and the realloc()s take a block off the queue and wait for
+ * the chunk in flight, the thread never touches freed memory.
+ * malloc_glue_prefault_wait()/cancel() let the application do the
+ * same. Up to PREFAULT_MAX_JOBS blocks are queued, others fault in
+ * as usual. Kernels before 5.14 don't have MADV_POPULATE_WRITE,
+ * the thread gives up after the first try there.
+ */
+#define PREFAULT_MAX_JOBS 8
+
+typedef struct prefault_job {
+    char* ptr;
+    size_t size;
+    size_t done;
+    uint64_t seq;
+    // a chunk is being faulted in right now
+    bool busy;
+    bool cancelled;
+} prefault_job;
+
+// protected by prefault_lock
+static prefault_job prefault_jobs[PREFAULT_MAX_JOBS];
+static uint64_t prefault_seq = 0;
+static bool prefault_running = false;
+static pthread_mutex_t prefault_lock = PTHREAD_MUTEX_INITIALIZER;
+// new jobs for the thread, finished jobs for the waiters
+static pthread_cond_t prefault_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefault_done = PTHREAD_COND_INITIALIZER;
+
+// what free() looks at before taking the lock
+static atomic_uintptr_t prefault_ptrs[PREFAULT_MAX_JOBS];
+static atomic_uint prefault_queued = 0;
+// SIZE once the thread runs
+static size_t prefault_min = SIZE_MAX;
+
+static void prefault_finish(prefault_job* job) {
+    atomic_store_explicit(&prefault_ptrs[job - prefault_jobs], 0, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&prefault_queued, 1, memory_order_relaxed);
+    job->ptr = NULL;
+    pthread_cond_broadcast(&prefault_done);
+}
+
+static void* prefault_thread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&prefault_lock);
+    for (;;) {
+        // oldest first
+        prefault_job* job = NULL;
+        for (int i = 0; i < PREFAULT_MAX_JOBS; i++) {
+            prefault_job* candidate = &prefault_jobs[i];
+            if (candidate->ptr && !candidate->cancelled && (!job || candidate->seq < job->seq)) {
+                job = candidate;
+            }
+        }
+        if (!job) {
+            pthread_cond_wait(&prefault_work, &prefault_lock);
+            continue;
+        }
+
+        char* start = job->ptr + job->done;
+        size_t len = job->size - job->done < config.prefault_chunk ? job->size - job->done : config.prefault_chunk;
+        // the page the chunk starts in is mapped, the block is in there
+        char* page = (char*)((uintptr_t)start & ~(uintptr_t)(large_page - 1));
+        job->busy = true;
+        pthread_mutex_unlock(&prefault_lock);
+        int ret = madvise(page, len + (size_t)(start - page), MADV_POPULATE_WRITE);
+        int err = errno;
+        pthread_mutex_lock(&prefault_lock);
+        job->busy = false;
+        job->done += len;
+
+        if (ret != 0 && err == EINVAL) {
+            fprintf(stderr, "malloc-glue: kernel can't prefault (no MADV_POPULATE_WRITE)\n");
+            prefault_min = SIZE_MAX;
+            for (int i = 0; i < PREFAULT_MAX_JOBS; i++) {
+                if (prefault_jobs[i].ptr) {
+                    prefault_finish(&prefault_jobs[i]);
+                }
+            }
+            break;
+        }
+        if (ret != 0 || job->cancelled || job->done >= job->size) {
+#ifndef NDEBUG
+            fprintf(stderr, "Prefaulted %zu of %zu bytes at %p\n", job->done, job->size, (void*)job->ptr);
+#endif
+            prefault_finish(job);
+        }
+    }
+    pthread_mutex_unlock(&prefault_lock);
+    return NULL;
+}
+
+static void prefault_start(void) {
+    if (!config.prefault || prefault_running) {
+        return;
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prefault_thread, NULL) == 0) {
+        pthread_setname_np(thread, "malloc-glue-pf");
+        prefault_running = true;
+        prefault_min = config.prefault;
+    } else {
+        fprintf(stderr, "malloc-glue: failed to start the prefault thread\n");
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void prefault_queue(void* ptr, size_t size) {
+    pthread_mutex_lock(&prefault_lock);
+    for (int i = 0; i < PREFAULT_MAX_JOBS; i++) {
+        prefault_job* job = &prefault_jobs[i];
+        if (!job->ptr) {
+            *job = (prefault_job){ ptr, size, 0, prefault_seq++, false, false };
+            atomic_store_explicit(&prefault_ptrs[i], (uintptr_t)ptr, memory_order_relaxed);
+            atomic_fetch_add_explicit(&prefault_queued, 1, memory_order_relaxed);
+            pthread_cond_signal(&prefault_work);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prefault_lock);
+}
+
+/**
+ * Queue a fresh block if it's big enough
+ */
+static inline void* prefault_new(void* ptr, size_t size) {
+    // scoped heaps go away without free()
+    if (__builtin_expect(size >= prefault_min, 0) && ptr && !tls_scope_depth) {
+        prefault_queue(ptr, size);
+    }
+    return ptr;
+}
+
+static prefault_job* prefault_find(const void* ptr) {
+    for (int i = 0; i < PREFAULT_MAX_JOBS; i++) {
+        if (prefault_jobs[i].ptr == ptr) {
+            return &prefault_jobs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Stop prefaulting ptr, returns once the thread is done with it
+ */
+static bool prefault_cancel(const void* ptr) {
+    pthread_mutex_lock(&prefault_lock);
+    prefault_job* job = prefault_find(ptr);
+    if (job) {
+        job->cancelled = true;
+        while (job->ptr == ptr && job->busy) {
+            pthread_cond_wait(&prefault_done, &prefault_lock);
+        }
+        if (job->ptr == ptr) {
+            prefault_finish(job);
+        }
+    }
+    pthread_mutex_unlock(&prefault_lock);
+    return job != NULL;
+}
+
+/**
+ * ptr is about to be freed or moved
+ */
+static inline void prefault_drop(const void* ptr) {
+    if (atomic_load_explicit(&prefault_queued, memory_order_relaxed) == 0 || !ptr) {
+        return;
+    }
+    for (int i = 0; i < PREFAULT_MAX_JOBS; i++) {
+        if (atomic_load_explicit(&prefault_ptrs[i], memory_order_relaxed) == (uintptr_t)ptr) {
+            prefault_cancel(ptr);
+            return;
+        }
+    }
+}
+
+/**
+ * NUMA mode (MALLOC_GLUE_NUMA=1)
+ *
+ * At init every node gets an arena of numa_reserve bytes of address
+ * space (preferring that node's memory) and every thread gets a heap
+ * in the arena of each node it runs on.
+ * The allocating wrappers check the CPU the thread is on (a load from
+ * the rseq area, sched_getcpu() every 64 calls without rseq) and switch
+ * the thread's default heap once it got migrated to another node.
+ * Inside a scope the thread stays on the scope's heap.
+ */
+typedef int mi_arena_id_t;
+
+static numa_topology topology;
+static mi_arena_id_t numa_arenas[NUMA_MAX_NODES];
+static bool numa_enabled = false;
+static bool numa_rseq = false;
+// arena is full, threads on this node go back to their own heap
+static atomic_bool numa_full[NUMA_MAX_NODES];
+
+static __thread int tls_numa_cpu __attribute__((tls_model("initial-exec"))) = -1;
+static __thread int tls_numa_node __attribute__((tls_model("initial-exec"))) = -1;
+static __thread unsigned tls_numa_tick __attribute__((tls_model("initial-exec")));
+static __thread void* tls_numa_heaps[NUMA_MAX_NODES] __attribute__((tls_model("initial-exec")));
+// default heap of the thread before we started switching
+static __thread void* tls_numa_home __attribute__((tls_model("initial-exec")));
+
+/**
+ * Reserve the per-node arenas (called from load_backend())
+ */
+static void numa_setup(void) {
+    if (!config.numa) {
+        return;
+    }
+    int version = ext.version ? ext.version() : 0;
+    if (!ext.manage_os_memory_ex || !ext.heap_new_in_arena || !ext.heap_set_default || version >= 300) {
+        fprintf(stderr, "malloc-glue: backend doesn't support NUMA heaps\n");
+        return;
+    }
+    if (!numa_topology_load(&topology, config.numa_fake)) {
+        fprintf(stderr, "malloc-glue: can't determine the NUMA topology\n");
+        return;
+    }
+
+    for (int node = 0; node < topology.nodes; node++) {
+        if (!(topology.cpu_nodes & (1u << node))) {
+            continue;
+        }
+        // only address space until it's touched
+        void* start = map_arena(config.numa_reserve, MAP_NORESERVE);
+        if (!start) {
+            fprintf(stderr, "malloc-glue: failed to reserve memory for node %d\n", node);
+            return;
+        }
+        if (!topology.fake && numa_bind_memory(start, config.numa_reserve, node) != 0) {
+#ifndef NDEBUG
+            fprintf(stderr, "mbind() for node %d failed: %s\n", node, strerror(errno));
+#endif
+        }
+        if (!ext.manage_os_memory_ex(start, config.numa_reserve, true, false, true, node, false, &numa_arenas[node])) {
+            fprintf(stderr, "malloc-glue: backend refused the arena for node %d\n", node);
+            munmap(start, config.numa_reserve);
+            return;
+        }
+#ifndef NDEBUG
+        fprintf(stderr, "NUMA node %d: arena %d at %p\n", node, numa_arenas[node], start);
+#endif
+    }
+    numa_rseq = numa_have_rseq();
+    numa_enabled = true;
+}
+
+/**
+ * Thread moved to another CPU, switch heaps if the node changed
+ */
+static __attribute__((noinline)) void numa_rebind(int cpu) {
+    tls_numa_cpu = cpu;
+    int node = cpu >= 0 && cpu < NUMA_MAX_CPUS ? topology.cpu_node[cpu] : -1;
+    if (node < 0 || node == tls_numa_node) {
+        return;
+    }
+
+    void* heap = NULL;
+    if (!atomic_load_explicit(&numa_full[node], memory_order_relaxed)) {
+        heap = tls_numa_heaps[node];
+        if (!heap) {
+            heap = tls_numa_heaps[node] = ext.heap_new_in_arena(numa_arenas[node]);
+        }
+    }
+    if (!heap) {
+        heap = tls_numa_home;
+    }
+    if (heap) {
+        void* prev = ext.heap_set_default(heap);
+        if (!tls_numa_home) {
+            tls_numa_home = prev;
+        }
+    }
+    tls_numa_node = node;
+}
+
+static inline void numa_check(void) {
+    if (!numa_enabled || tls_scope_depth) {
+        return;
+    }
+    int cpu;
+    if (numa_rseq) {
+        cpu = numa_rseq_cpu();
+    } else {
+        if (tls_numa_tick++ & 63) {
+            return;
+        }
+        cpu = sched_getcpu();
+    }
+    if (cpu != tls_numa_cpu) {
+        numa_rebind(cpu);
+    }
+}
+
+/**
+ * An allocation failed, if it came from a node arena
+ * mark it full and go back to the thread's own heap
+ * Returns true if retrying makes sense
+ */
+static bool numa_retry(void) {
+    if (!numa_enabled || tls_numa_node < 0 || !tls_numa_home || tls_scope_depth) {
+        return false;
+    }
+    if (ext.heap_set_default(tls_numa_home) == tls_numa_home) {
+        // failed on the thread's own heap, nothing left to try
+        return false;
+    }
+#ifndef NDEBUG
+    fprintf(stderr, "NUMA node %d arena is full\n", tls_numa_node);
+#endif
+    atomic_store_explicit(&numa_full[tls_numa_node], true, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Get handles for libc and the backend
+ * safe to call again, dlopen() only bumps the refcount
+ */
+static void open_backend(void) {
+    // try to get a handle for existing libc
+    libc_so = dlopen("libc.so.6", RTLD_LAZY | RTLD_NOLOAD);
+    if (!libc_so) {
+        fprintf(stderr, "libc.so.6 not loaded\n");
+        abort();
+    }
+
+    // "libc" -> nothing to load, resolve_func() keeps the next symbols
+    if (strcmp(config.backend, "libc") == 0) {
+        return;
+    }
+
+    // try to load and get a handle for the backend
+    backend_so = dlopen(config.backend, RTLD_LAZY | RTLD_LOCAL);
+    if (!backend_so) {
+        fprintf(stderr, "Failed to load %s\n", config.backend);
+        abort();
+    }
+    set_backend_name(config.backend);
+
+    // these are only ever called by us so no need to check search order
+    ext.process_info = dlsym(backend_so, "mi_process_info");
+    ext.collect = dlsym(backend_so, "mi_collect");
+    ext.version = dlsym(backend_so, "mi_version");
+    ext.option_set = dlsym(backend_so, "mi_option_set");
+    ext.option_get = dlsym(backend_so, "mi_option_get");
+    ext.manage_os_memory_ex = dlsym(backend_so, "mi_manage_os_memory_ex");
+    ext.heap_new_in_arena = dlsym(backend_so, "mi_heap_new_in_arena");
+    ext.heap_set_default = dlsym(backend_so, "mi_heap_set_default");
+    ext.heap_new = dlsym(backend_so, "mi_heap_new");
+    ext.heap_destroy = dlsym(backend_so, "mi_heap_destroy");
+    ext.heap_contains_block = dlsym(backend_so, "mi_heap_contains_block");
+    ext.heap_delete = dlsym(backend_so, "mi_heap_delete");
+    ext.heap_malloc = dlsym(backend_so, "mi_heap_malloc");
+    ext.heap_malloc_aligned = dlsym(backend_so, "mi_heap_malloc_aligned");
+    ext.free_size_aligned = dlsym(backend_so, "mi_free_size_aligned");
+    ext.malloc_small = dlsym(backend_so, "mi_malloc_small");
+    ext.expand = dlsym(backend_so, "mi_expand");
+    ext.reserve_huge_os_pages_interleave = dlsym(backend_so, "mi_reserve_huge_os_pages_interleave");
+}
+
+/**
+ * Configure the backend before it serves anything
+ * not safe to call twice, this reserves memory
+ */
+static void setup_backend(void) {
+    if (!backend_so) {
+        return;
+    }
+    apply_profile();
+    maint_setup();
+    huge_setup();
+    prewarm_setup();
+    numa_setup();
+}
+
+static void load_backend(void) {
+    open_backend();
+    setup_backend();
+}
+
+/**
+ * Resolve a function named symbol
+ * If RTLD_NEXT is from libc return custom
+ * else return whatever it is
+ */
+static void* resolve_func(const char* symbol) {
+    // address of the symbol in libc
+    void* libc_sym = dlsym(libc_so, symbol);
+#ifndef NDEBUG
+    if (libc_sym) {
+        fprintf(stderr, "%s() found in libc: %p\n", symbol, libc_sym);
+    } else {
+        fprintf(stderr, "%s() not found in libc\n", symbol);
+    }
+#endif
+
+    // address of the symbol in the backend
+    void* backend_sym = backend_so ? dlsym(backend_so, symbol) : NULL;
+#ifndef NDEBUG
+    if (backend_sym) {
+        fprintf(stderr, "%s() found in backend: %p\n", symbol, backend_sym);
+    } else {
+        fprintf(stderr, "%s() not found in backend\n", symbol);
+    }
+#endif
+
+    // address of the next (in search order) symbol
+    void* next_sym = dlsym(RTLD_NEXT, symbol);
+#ifndef NDEBUG
+    if (next_sym) {
+        fprintf(stderr, "%s() next in search order: %p\n", symbol, next_sym);
+    } else {
+        fprintf(stderr, "%s() not in any loaded object\n", symbol);
+    }
+#endif
+
+    // if next is NULL we don't want to map it here either
+    if (!next_sym) {
+#ifndef NDEBUG
+        fprintf(stderr, "%s() leaving undefined\n", symbol);
+#endif
+        return NULL;
+    }
+
+    // without a backend library just keep what's next
+    if (!backend_so) {
+#ifndef NDEBUG
+        fprintf(stderr, "%s() selected from search path: %p\n", symbol, next_sym);
+#endif
+        return next_sym;
+    }
+
+    // if next is either libc default or the backend select it
+    if (next_sym == libc_sym || next_sym == backend_sym) {
+#ifndef NDEBUG
+        fprintf(stderr, "%s() selected from backend: %p\n", symbol, backend_sym);
+#endif
+        return backend_sym;
+    }
+
+    // if not that means another library already claimed the symbol
+    // use that version then
+#ifndef NDEBUG
+    fprintf(stderr, "%s() selected from search path: %p\n", symbol, next_sym);
+#endif
+    return next_sym;
+}
+
+/**
+ * Resolve every symbol and switch the LUT over to them
+ * (backend must be loaded)
+ */
+static void resolve_lut(void) {
+    // now resolve
+    void* malloc = resolve_func("malloc");
+    void* calloc = resolve_func("calloc");
+    void* realloc = resolve_func("realloc");
+    void* free = resolve_func("free");
+    void* strdup = resolve_func("strdup");
+    void* strndup = resolve_func("strndup");
     void* realpath = resolve_func("realpath");
-    void* reallocf = resolve_func("reallocf");
     void* malloc_size = resolve_func("malloc_size");
     void* malloc_usable_size = resolve_func("malloc_usable_size");
     void* malloc_good_size = resolve_func("malloc_good_size");
@@ -245,51 +1449,1418 @@ static void init(void) {
     void* posix_memalign = resolve_func("posix_memalign");
     void* _posix_memalign = resolve_func("_posix_memalign");
 
-#ifndef NDEBUG
-    fprintf(stderr, "All functions resolved\n");
-#endif
+#ifndef NDEBUG
+    fprintf(stderr, "All functions resolved\n");
+#endif
+
+    // finally bulk update
+    lut.malloc = malloc;
+    lut.calloc = calloc;
+    lut.realloc = realloc;
+    lut.free = free;
+    lut.strdup = strdup;
+    lut.strndup = strndup;
+    lut.realpath = realpath;
+    lut.malloc_size = malloc_size;
+    lut.malloc_usable_size = malloc_usable_size;
+    lut.malloc_good_size = malloc_good_size;
+    lut.cfree = cfree;
+    lut.valloc = valloc;
+    lut.pvalloc = pvalloc;
+    lut.reallocarray = reallocarray;
+    lut.reallocarr = reallocarr;
+    lut.memalign = memalign;
+    lut.aligned_alloc = aligned_alloc;
+    lut.posix_memalign = posix_memalign;
+    lut._posix_memalign = _posix_memalign;
+
+    // blocks from the backend's own entry points (and heaps) have to go
+    // back to the backend, if another library claimed malloc() or free()
+    // the wrappers would hand them to that one so stick to the LUT
+    if (backend_so && (malloc != dlsym(backend_so, "malloc") || free != dlsym(backend_so, "free"))) {
+#ifndef NDEBUG
+        fprintf(stderr, "malloc()/free() aren't the backend's, disabling its extensions\n");
+#endif
+        ext.free_size_aligned = NULL;
+        ext.malloc_small = NULL;
+        ext.expand = NULL;
+        ext.heap_new = NULL;
+        ext.heap_contains_block = NULL;
+    }
+}
+
+/**
+ * Lazy switch-over state (MALLOC_GLUE_LAZY)
+ * While lazy_pending is set everything is served from libc through libc_lut
+ */
+static malloc_lut libc_lut;
+static atomic_bool lazy_pending = false;
+// held across the backend's dlopen() instead of mutex (see lazy_switch())
+static pthread_mutex_t lazy_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+static void lazy_start(void);
+
+static pthread_mutex_t mutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+
+// INIT_RESTART: initialised, but a fork() child that
+// still has to start its own threads (see threads_start())
+enum init_state {
+    INIT_NONE,
+    INIT_DONE,
+    INIT_RESTART
+};
+static enum init_state init_state = INIT_NONE;
+static void threads_start(void);
+
+/**
+ * Initialisation, runs once.
+ * This initially sets a default "real" malloc interface
+ * for following dlopen() calls to work.
+ * Once we have working malloc we load our custom malloc shared object
+ * and replace all symbols with their equivalent version from it.
+ *
+ * glue_start() calls it on load, but every wrapper calls it as well:
+ * other libraries' constructors (and the loader) may allocate before
+ * ours runs, we can't predict the order the dynamic linker calls them in
+ */
+static void init(void) {
+    if (init_state == INIT_DONE) {
+        return;
+    }
+
+    // EDEADLK -> we are the initialising thread
+    // all expected and good... I think
+    // ... we *should* have the temporary init malloc
+    if (pthread_mutex_lock(&mutex) == EDEADLK) {
+        return;
+    }
+
+    // catch potential threads that waited for init to complete
+    if (init_state == INIT_DONE) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+
+    // first call in a fork() child, done before the threads start
+    // so the allocations pthread_create() makes don't come back here
+    if (init_state == INIT_RESTART) {
+        init_state = INIT_DONE;
+        pthread_mutex_unlock(&mutex);
+        threads_start();
+        return;
+    }
+
+#ifndef NDEBUG
+    fprintf(stderr, "Starting initialisation\n");
+#endif
+
+    load_config();
+
+    // temporarily set defaults for resolve_func() to work
+    lut.malloc = dlsym(RTLD_NEXT, "malloc");
+    lut.calloc = dlsym(RTLD_NEXT, "calloc");
+    lut.realloc = dlsym(RTLD_NEXT, "realloc");
+    lut.free = dlsym(RTLD_NEXT, "free");
+    lut.strdup = dlsym(RTLD_NEXT, "strdup");
+    lut.strndup = dlsym(RTLD_NEXT, "strndup");
+    lut.realpath = dlsym(RTLD_NEXT, "realpath");
+    lut.malloc_size = dlsym(RTLD_NEXT, "malloc_size");
+    lut.malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    lut.malloc_good_size = dlsym(RTLD_NEXT, "malloc_good_size");
+    lut.cfree = dlsym(RTLD_NEXT, "cfree");
+    lut.valloc = dlsym(RTLD_NEXT, "valloc");
+    lut.pvalloc = dlsym(RTLD_NEXT, "pvalloc");
+    lut.reallocarray = dlsym(RTLD_NEXT, "reallocarray");
+    lut.reallocarr = dlsym(RTLD_NEXT, "reallocarr");
+    lut.memalign = dlsym(RTLD_NEXT, "memalign");
+    lut.aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    lut.posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    lut._posix_memalign = dlsym(RTLD_NEXT, "_posix_memalign");
+
+#ifndef NDEBUG
+    fprintf(stderr, "Temporary malloc set\n");
+#endif
+
+    if (config.lazy) {
+        lazy_start();
+    } else {
+        load_backend();
+        resolve_lut();
+    }
+
+#ifndef NDEBUG
+    fprintf(stderr, "Finished initialisation\n");
+#endif
+
+    init_state = INIT_DONE;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * fork() handling
+ *
+ * If one thread forks while another one is inside init() the child
+ * would inherit a locked mutex (owned by a thread that doesn't exist there)
+ * and a half written LUT, deadlocking on its first malloc.
+ * So we hold the mutex across fork() which makes fork() wait
+ * for a running init() and guarantees the child sees either
+ * no LUT at all or a complete one.
+ * The other locks are held across fork() the same way, in lock order,
+ * so the child never finds a pool or pointer set half updated.
+ */
+static bool atfork_locked = false;
+
+// maintenance thread, see maint_thread()
+static bool maint_running = false;
+
+// release callbacks, see release_run()
+static pthread_mutex_t release_lock = PTHREAD_MUTEX_INITIALIZER;
+// global buffer pool, see pool_alloc()
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// ownership sets, their locks come last in the lock order
+static ptrset lazy_owned, large_owned, pool_owned, colour_owned;
+
+static void atfork_prepare(void) {
+    // compact the heap first so the child shares fewer dirty pages
+    // (less copy-on-write faults in prefork servers)
+    if (init_state != INIT_NONE && config.prefork_collect && ext.collect) {
+#ifndef NDEBUG
+        fprintf(stderr, "Collecting heap before fork()\n");
+#endif
+        ext.collect(true);
+    }
+
+    // EDEADLK -> fork() from within init() on this thread
+    // nothing we can do about that, just don't unlock later
+    atfork_locked = pthread_mutex_lock(&mutex) == 0;
+    // same order as everywhere else: release callbacks may free
+    // into the pool, nothing takes a set lock and then another one
+    pthread_mutex_lock(&release_lock);
+    pthread_mutex_lock(&pool_lock);
+    pthread_mutex_lock(&prefault_lock);
+    pthread_mutex_lock(&lazy_owned.lock);
+    pthread_mutex_lock(&large_owned.lock);
+    pthread_mutex_lock(&pool_owned.lock);
+    pthread_mutex_lock(&colour_owned.lock);
+}
+
+static void atfork_parent(void) {
+    pthread_mutex_unlock(&colour_owned.lock);
+    pthread_mutex_unlock(&pool_owned.lock);
+    pthread_mutex_unlock(&large_owned.lock);
+    pthread_mutex_unlock(&lazy_owned.lock);
+    pthread_mutex_unlock(&prefault_lock);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&release_lock);
+    if (atfork_locked) {
+        atfork_locked = false;
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+static void atfork_child(void) {
+    // plain mutexes don't care which thread unlocks them
+    pthread_mutex_unlock(&colour_owned.lock);
+    pthread_mutex_unlock(&pool_owned.lock);
+    pthread_mutex_unlock(&large_owned.lock);
+    pthread_mutex_unlock(&lazy_owned.lock);
+    pthread_mutex_unlock(&prefault_lock);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&release_lock);
+
+    // the owner of the copied mutex is the parent's thread
+    // so we can't unlock it here, start with a fresh one instead
+    pthread_mutex_t fresh = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+    mutex = fresh;
+    atfork_locked = false;
+    // fork() may hit a lazy switch in its dlopen(), the child redoes it
+    lazy_lock = fresh;
+
+    // the parent's prefault thread is gone, and so are its jobs
+    // the conds still count it as a waiter, those start over too
+    pthread_cond_t prefault_cond_fresh = PTHREAD_COND_INITIALIZER;
+    prefault_work = prefault_cond_fresh;
+    prefault_done = prefault_cond_fresh;
+    for (int i = 0; i < PREFAULT_MAX_JOBS; i++) {
+        prefault_jobs[i].ptr = NULL;
+        atomic_store(&prefault_ptrs[i], 0);
+    }
+    atomic_store(&prefault_queued, 0);
+    prefault_running = false;
+    prefault_min = SIZE_MAX;
+
+    // threads don't survive fork(), prefork workers want theirs too
+    // but creating threads in here isn't async-signal-safe,
+    // the child's first call into the glue starts them
+    maint_running = false;
+    if (init_state == INIT_DONE) {
+        init_state = INIT_RESTART;
+    }
+}
+
+/**
+ * Start the async prewarm, see prewarm_setup()
+ */
+static void prewarm_start(void) {
+    if (!atomic_exchange(&prewarm_pending, false)) {
+        return;
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prewarm_thread, NULL) != 0) {
+        prewarm_populate();
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * Check if a symbol is defined (not NULL)
+ * if it isn't abort
+ */
+static void check_defined(void* symbol, const char* name) {
+    if (symbol == NULL) {
+        fprintf(stderr, "%s() is not defined\n", name);
+        abort();
+    }
+}
+
+/**
+ * Call counters (MALLOC_GLUE_STATS or stats=1 in the policy,
+ * also used by the maintenance thread)
+ *
+ * Threads count locally and only publish every STATS_BATCH calls
+ * so enabled stats don't turn into a shared cache line every malloc
+ * bounces around. Up to STATS_BATCH - 1 calls of exited threads are lost.
+ */
+#define STATS_BATCH 64
+
+typedef struct thread_stats {
+    size_t allocs;
+    size_t frees;
+    size_t reallocs;
+    size_t bytes;
+    unsigned pending;
+} thread_stats;
+
+static struct {
+    atomic_size_t allocs;
+    atomic_size_t frees;
+    atomic_size_t reallocs;
+    atomic_size_t bytes;
+    // what size + alignment over-allocation would have cost more
+    // than the aligned large mappings (see large_alloc_aligned())
+    atomic_size_t align_saved;
+} stats;
+
+// initial-exec so TLS access never ends up in __tls_get_addr() (which can malloc)
+static __thread thread_stats tstats __attribute__((tls_model("initial-exec")));
+
+static void flush_stats(void) {
+    atomic_fetch_add_explicit(&stats.allocs, tstats.allocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.frees, tstats.frees, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.reallocs, tstats.reallocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.bytes, tstats.bytes, memory_order_relaxed);
+    tstats = (thread_stats){ 0, 0, 0, 0, 0 };
+}
+
+static inline void count_alloc(size_t size) {
+    if (!counting) {
+        return;
+    }
+    tstats.allocs++;
+    tstats.bytes += size;
+    if (++tstats.pending >= STATS_BATCH) {
+        flush_stats();
+    }
+}
+
+static inline void count_realloc(size_t size) {
+    if (!counting) {
+        return;
+    }
+    tstats.reallocs++;
+    tstats.bytes += size;
+    if (++tstats.pending >= STATS_BATCH) {
+        flush_stats();
+    }
+}
+
+static inline void count_free(void) {
+    if (!counting) {
+        return;
+    }
+    tstats.frees++;
+    if (++tstats.pending >= STATS_BATCH) {
+        flush_stats();
+    }
+}
+
+/**
+ * Many calls at once (batch API)
+ */
+static inline void count_batch(size_t allocs, size_t frees, size_t bytes) {
+    if (!counting) {
+        return;
+    }
+    tstats.allocs += allocs;
+    tstats.frees += frees;
+    tstats.bytes += bytes;
+    tstats.pending += (unsigned)(allocs + frees);
+    if (tstats.pending >= STATS_BATCH) {
+        flush_stats();
+    }
+}
+
+/**
+ * Print the counters on exit
+ */
+__attribute__((destructor))
+static void report_stats(void) {
+    if (!config.stats) {
+        return;
+    }
+    flush_stats();
+    fprintf(stderr, "malloc-glue: backend=%s allocs=%zu reallocs=%zu frees=%zu bytes=%zu\n",
+            backend_name,
+            atomic_load(&stats.allocs),
+            atomic_load(&stats.reallocs),
+            atomic_load(&stats.frees),
+            atomic_load(&stats.bytes));
+    if (config.thp || config.huge_2m || config.huge_1g) {
+        fprintf(stderr, "malloc-glue: huge page backed=%zu bytes\n", huge_backed_bytes());
+    }
+    if (atomic_load(&stats.align_saved)) {
+        fprintf(stderr, "malloc-glue: aligned mappings saved=%zu bytes\n", atomic_load(&stats.align_saved));
+    }
+}
+
+/**
+ * Lazy backend switch-over (MALLOC_GLUE_LAZY=1)
+ *
+ * Most short-lived processes never benefit from loading the backend,
+ * so we keep serving them from libc and only switch over once
+ * the process made MALLOC_GLUE_LAZY_ALLOCS allocations,
+ * allocated MALLOC_GLUE_LAZY_BYTES or lived for MALLOC_GLUE_LAZY_MS.
+ *
+ * Every block handed out by libc before that is remembered in lazy_owned
+ * so free(), realloc() & co. can give it back to libc afterwards.
+ * The set is twice as big as the allocation limit so the threads
+ * racing the switch always find a free slot.
+ */
+#define LAZY_MAX_ALLOCS 4096
+
+static atomic_uintptr_t lazy_slots[2 * LAZY_MAX_ALLOCS];
+static ptrset lazy_owned = PTRSET_INIT(lazy_slots);
+
+static atomic_size_t lazy_alloc_count = 0;
+static atomic_size_t lazy_byte_count = 0;
+static uint64_t lazy_deadline_ns = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Called by init() instead of loading the backend
+ * (mutex held, lut has the libc defaults)
+ */
+static void lazy_start(void) {
+    if (config.lazy_allocs > LAZY_MAX_ALLOCS) {
+        config.lazy_allocs = LAZY_MAX_ALLOCS;
+    }
+    libc_lut = lut;
+    lazy_deadline_ns = now_ns() + (uint64_t)config.lazy_ms * 1000000ull;
+    atomic_store_explicit(&lazy_pending, true, memory_order_release);
+#ifndef NDEBUG
+    fprintf(stderr, "Lazy mode, serving from libc\n");
+#endif
+}
+
+static inline bool lazy_active(void) {
+    return atomic_load_explicit(&lazy_pending, memory_order_acquire);
+}
+
+/**
+ * Load the backend and switch the LUT over
+ */
+static void lazy_switch(void) {
+    // EDEADLK -> we are the thread switching (e.g. dlopen() allocating)
+    // just keep using libc until we're done
+    if (pthread_mutex_lock(&lazy_lock) == EDEADLK) {
+        return;
+    }
+    if (lazy_active()) {
+#ifndef NDEBUG
+        fprintf(stderr, "Lazy mode: switching to backend after %zu allocations, %zu bytes\n",
+                atomic_load(&lazy_alloc_count), atomic_load(&lazy_byte_count));
+#endif
+        // not under mutex: the backend's constructor may call pthread_atfork(),
+        // which waits for a concurrent fork() that waits for mutex in atfork_prepare()
+        open_backend();
+        // EDEADLK -> still inside init(), switch on a later allocation
+        if (pthread_mutex_lock(&mutex) == EDEADLK) {
+            pthread_mutex_unlock(&lazy_lock);
+            return;
+        }
+        setup_backend();
+        resolve_lut();
+        atomic_store_explicit(&lazy_pending, false, memory_order_release);
+        pthread_mutex_unlock(&mutex);
+    }
+    pthread_mutex_unlock(&lazy_lock);
+}
+
+/**
+ * Remember a block libc handed out
+ * and switch over once the process proved to be worth it
+ */
+static void* lazy_track(void* ptr, size_t size) {
+    if (!ptr) {
+        return NULL;
+    }
+    if (!ptrset_insert(&lazy_owned, ptr) && !ptrset_contains(&lazy_owned, ptr)) {
+        // can't happen unless thousands of threads race the switch
+        fprintf(stderr, "malloc-glue: lazy mode ownership table full\n");
+        abort();
+    }
+
+    size_t allocs = atomic_fetch_add_explicit(&lazy_alloc_count, 1, memory_order_relaxed) + 1;
+    size_t bytes = atomic_fetch_add_explicit(&lazy_byte_count, size, memory_order_relaxed) + size;
+    if (allocs >= config.lazy_allocs || bytes >= config.lazy_bytes || now_ns() >= lazy_deadline_ns) {
+        lazy_switch();
+    }
+    return ptr;
+}
+
+/**
+ * realloc() for lazy mode
+ * either still in libc or moving a libc block to the backend
+ */
+static void* lazy_realloc(void* ptr, size_t size) {
+    if (lazy_active()) {
+        bool tracked = ptr && ptrset_remove(&lazy_owned, ptr);
+        void* ret = libc_lut.realloc(ptr, size);
+        if (ret) {
+            return lazy_track(ret, size);
+        }
+        // failed (or realloc(ptr, 0) freed it), old block stays ours if it's still alive
+        if (tracked && size) {
+            ptrset_insert(&lazy_owned, ptr);
+        }
+        return NULL;
+    }
+
+    // switched, ptr came from libc
+    void* ret = lut.malloc(size);
+    if (!ret) {
+        return NULL;
+    }
+    size_t old = libc_lut.malloc_usable_size(ptr);
+    memcpy(ret, ptr, old < size ? old : size);
+    ptrset_remove(&lazy_owned, ptr);
+    libc_lut.free(ptr);
+    return ret;
+}
+
+/**
+ * Does ptr have to go back to libc
+ */
+static inline bool lazy_is_libc(const void* ptr) {
+    return ptrset_contains(&lazy_owned, ptr);
+}
+
+/**
+ * Large blocks (MALLOC_GLUE_LARGE=SIZE)
+ *
+ * malloc(), calloc() and the realloc()s of at least SIZE bytes get
+ * a mapping of their own, realloc() resizes it with mremap() which
+ * moves the pages instead of copying them. Shrinking below SIZE
+ * moves the block back to the backend.
+ *
+ * With MALLOC_GLUE_LARGE_ALIGN=ALIGN the aligned calls asking for at
+ * least ALIGN (64K DMA buffers, 2M for huge pages) get one as well.
+ * The mapping is cut to the aligned block so nothing is lost to the
+ * size + alignment over-allocation, realloc() doesn't keep the
+ * alignment (just like with the backend).
+ *
+ * The first page of the mapping holds its size, the block starts
+ * right after it. Blocks are remembered in large_owned, ordinary
+ * blocks only pay for an alignment check on free() (see large_mask).
+ *
+ * Large blocks in the MALLOC_GLUE_COLOUR range start at an offset
+ * into their first page (see large_colour()), that costs at most one
+ * more page and makes free() look up every cache line aligned pointer.
+ * Once the set is full large requests go to the backend again.
+ */
+#define LARGE_MAX_BLOCKS 1024
+
+// the wrapper, knows whose block it is
+size_t malloc_usable_size(void* ptr);
+
+static atomic_uintptr_t large_slots[2 * LARGE_MAX_BLOCKS];
+static ptrset large_owned = PTRSET_INIT(large_slots);
+
+static atomic_uint large_colour_next = 0;
+
+static inline bool large_route(enum route route) {
+    return route == ROUTE_LARGE;
+}
+
+static inline bool large_wanted(size_t size) {
+    return large_route(route_for(&routes, size, 0));
+}
+
+static inline bool large_is_ours(const void* ptr) {
+    return ((uintptr_t)ptr & large_mask) == 0 && ptr && ptrset_contains(&large_owned, ptr);
+}
+
+static inline size_t* large_header(void* ptr) {
+    return (size_t*)(((uintptr_t)ptr & ~(uintptr_t)(large_page - 1)) - large_page);
+}
+
+// colour offset of the block
+static inline size_t large_offset(void* ptr) {
+    return (uintptr_t)ptr & (large_page - 1);
+}
+
+static inline size_t large_usable(void* ptr) {
+    return (size_t)((char*)large_header(ptr) + *large_header(ptr) - (char*)ptr);
+}
+
+/**
+ * Mapping size for a block of size bytes at offset, 0 on overflow
+ */
+static size_t large_map_size(size_t size, size_t offset) {
+    size_t map;
+    if (__builtin_add_overflow(size, offset + 2 * large_page - 1, &map)) {
+        return 0;
+    }
+    return map & ~(large_page - 1);
+}
+
+/**
+ * Cache colouring
+ * Page aligned blocks all start in the same cache sets, so their
+ * headers keep evicting each other. Coloured blocks start at an
+ * offset into their first page instead, successive blocks at
+ * successive multiples of the cache line (or of the requested
+ * alignment if that's bigger).
+ * Returns the offset of the next coloured block, 0 for page alignment
+ */
+static size_t large_colour(size_t alignment) {
+    size_t step = alignment > COLOUR_LINE ? alignment : COLOUR_LINE;
+    if (step >= large_page) {
+        return 0;
+    }
+    unsigned colour = atomic_fetch_add_explicit(&large_colour_next, 1, memory_order_relaxed);
+    return colour % (large_page / step) * step;
+}
+
+static void* large_alloc_aligned(size_t size, size_t alignment) {
+    // inside a scope everything has to come from the scope's heap,
+    // end() frees what the thread didn't
+    if (tls_scope_depth) {
+        return NULL;
+    }
+    bool colour = size >= large_colour_min && size < large_colour_max;
+    size_t offset = colour ? large_colour(alignment) : 0;
+    size_t map = large_map_size(size, offset);
+    // mappings are page aligned, for more map the difference
+    // on top and cut the slack off again
+    size_t slack = alignment > large_page ? alignment - large_page : 0;
+    size_t reserve;
+    if (!map || (alignment & (alignment - 1)) || __builtin_add_overflow(map, slack, &reserve)) {
+        return NULL;
+    }
+    char* base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (slack) {
+        uintptr_t aligned = ((uintptr_t)base + large_page + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        char* header = (char*)aligned - large_page;
+        if (header > base) {
+            munmap(base, (size_t)(header - base));
+        }
+        if (header + map < base + reserve) {
+            munmap(header + map, (size_t)(base + reserve - (header + map)));
+        }
+        base = header;
+        size_t padded;
+        if (!__builtin_add_overflow(size, alignment, &padded) && padded > map) {
+            atomic_fetch_add_explicit(&stats.align_saved, padded - map, memory_order_relaxed);
+        }
+    }
+    void* ptr = base + large_page + offset;
+    if (!ptrset_insert(&large_owned, ptr)) {
+        munmap(base, map);
+        return NULL;
+    }
+    *(size_t*)base = map;
+    if (config.thp) {
+        // the whole mapping, a partly advised one is split in several
+        // vmas and mremap() can't move it anymore
+        madvise(base, map, MADV_HUGEPAGE);
+    }
+#ifndef NDEBUG
+    fprintf(stderr, "Large block %p: %zu bytes\n", ptr, size);
+#endif
+    return ptr;
+}
+
+static void* large_alloc(size_t size) {
+    return large_alloc_aligned(size, 0);
+}
+
+/**
+ * Aligned requests routed here
+ */
+static inline void* large_aligned(enum route route, size_t size, size_t alignment) {
+    return large_route(route) ? large_alloc_aligned(size, alignment) : NULL;
+}
+
+/**
+ * Unmap ptr if it's a large block
+ */
+static bool large_free(void* ptr) {
+    if (((uintptr_t)ptr & large_mask) != 0 || !ptr || !ptrset_remove(&large_owned, ptr)) {
+        return false;
+    }
+    munmap(large_header(ptr), *large_header(ptr));
+    return true;
+}
+
+/**
+ * realloc() for large blocks and blocks growing into one
+ * Returns false if neither is the case
+ */
+static bool large_realloc(void* ptr, size_t size, void** ret) {
+    if (!large_is_ours(ptr)) {
+        enum route route = route_for(&routes, size, 0);
+        if (!large_route(route) || !(*ret = large_alloc(size))) {
+            return false;
+        }
+        if (ptr) {
+            // the last copy this block will see
+            size_t old = malloc_usable_size(ptr);
+            memcpy(*ret, ptr, old < size ? old : size);
+            free(ptr);
+        }
+        return true;
+    }
+
+    size_t usable = large_usable(ptr);
+    if (!large_wanted(size)) {
+        if ((*ret = malloc(size))) {
+            memcpy(*ret, ptr, usable < size ? usable : size);
+            large_free(ptr);
+        }
+        return true;
+    }
+
+    size_t old_map = *large_header(ptr);
+    size_t offset = large_offset(ptr);
+    size_t map = large_map_size(size, offset);
+    if (!map) {
+        *ret = NULL;
+        return true;
+    }
+    if (map == old_map) {
+        *ret = ptr;
+        return true;
+    }
+    // holding the set's lock across the move keeps everyone else from
+    // taking the slot ptr frees up (or the old address) in the meantime,
+    // so we never end up with a block we don't own and the old one
+    // stays valid if it can't move (reallocf() frees it then)
+    ptrset_lock(&large_owned);
+    ptrset_remove_locked(&large_owned, ptr);
+    char* base = mremap(large_header(ptr), old_map, map, MREMAP_MAYMOVE);
+    *ret = base == MAP_FAILED ? NULL : base + large_page + offset;
+    ptrset_insert_locked(&large_owned, *ret ? *ret : ptr);
+    ptrset_unlock(&large_owned);
+    if (!*ret) {
+        return true;
+    }
+    *(size_t*)base = map;
+    if (config.thp) {
+        madvise(base, map, MADV_HUGEPAGE);
+    }
+    return true;
+}
+
+/**
+ * Grow or shrink a large block without moving it
+ * Returns the usable size or 0
+ */
+static size_t large_expand(void* ptr, size_t size) {
+    size_t map = large_map_size(size, large_offset(ptr));
+    size_t old_map = *large_header(ptr);
+    if (!map || (map > old_map && mremap(large_header(ptr), old_map, map, 0) == MAP_FAILED)) {
+        return 0;
+    }
+    if (map > old_map) {
+        *large_header(ptr) = map;
+    }
+    return large_usable(ptr);
+}
+
+/**
+ * Coloured backend blocks (colour routes, MALLOC_GLUE_COLOUR=MIN[-MAX])
+ *
+ * Requests on the colour route are page aligned backend blocks of
+ * size + offset bytes handed out offset bytes in (see large_colour()),
+ * the backend's block is the pointer rounded down to the page.
+ * No syscalls, the backend recycles them like any other block, but
+ * up to a page of slack each and a set lookup on free() for cache
+ * line aligned pointers that aren't page aligned. calloc() has to
+ * clear them by hand.
+ * Coloured blocks are tracked in colour_owned, realloc() keeps them
+ * in place while they fit and moves them otherwise, the backend
+ * can't resize a block from the middle. Blocks growing into the
+ * range through realloc() stay the backend's.
+ * With the set full (or an offset of 0) blocks stay page aligned.
+ */
+#define COLOUR_MAX_BLOCKS 4096
+
+static atomic_uintptr_t colour_slots[2 * COLOUR_MAX_BLOCKS];
+static ptrset colour_owned = PTRSET_INIT(colour_slots);
+
+static void* colour_alloc(size_t size, size_t alignment) {
+    // same as the large blocks, and the lazy LUT is libc's
+    if (tls_scope_depth || lazy_active()) {
+        return NULL;
+    }
+    size_t offset = large_colour(alignment);
+    size_t total;
+    void* base;
+    if (__builtin_add_overflow(size, offset, &total)) {
+        return NULL;
+    }
+    numa_check();
+    if (lut.posix_memalign(&base, alignment > large_page ? alignment : large_page, total) != 0) {
+        return NULL;
+    }
+    char* ptr = (char*)base + offset;
+    if (!offset || !ptrset_insert(&colour_owned, ptr)) {
+        return base;
+    }
+    return ptr;
+}
+
+static inline bool colour_is_ours(const void* ptr) {
+    return ((uintptr_t)ptr & (large_page - 1)) != 0 && ((uintptr_t)ptr & (COLOUR_LINE - 1)) == 0 &&
+           ptrset_contains(&colour_owned, ptr);
+}
+
+static inline void* colour_base(void* ptr) {
+    return (void*)((uintptr_t)ptr & ~(uintptr_t)(large_page - 1));
+}
+
+static inline size_t colour_usable(void* ptr) {
+    return lut.malloc_usable_size(colour_base(ptr)) - ((uintptr_t)ptr & (large_page - 1));
+}
+
+/**
+ * Give ptr back to the backend if it's a coloured block
+ */
+static bool colour_free(void* ptr) {
+    if (((uintptr_t)ptr & (large_page - 1)) == 0 || ((uintptr_t)ptr & (COLOUR_LINE - 1)) != 0 ||
+        !ptrset_remove(&colour_owned, ptr)) {
+        return false;
+    }
+    lut.free(colour_base(ptr));
+    return true;
+}
+
+/**
+ * realloc() for coloured blocks and new blocks on the colour route
+ * Returns false if neither is the case
+ */
+static bool colour_realloc(void* ptr, size_t size, void** ret) {
+    if (!ptr) {
+        return route_for(&routes, size, 0) == ROUTE_COLOUR && (*ret = colour_alloc(size, 0));
+    }
+    if (!colour_is_ours(ptr)) {
+        return false;
+    }
+    size_t usable = colour_usable(ptr);
+    if (size <= usable && route_for(&routes, size, 0) == ROUTE_COLOUR) {
+        *ret = ptr;
+        return true;
+    }
+    if ((*ret = malloc(size))) {
+        memcpy(*ret, ptr, usable < size ? usable : size);
+        colour_free(ptr);
+    }
+    return true;
+}
+
+/**
+ * Page aligned buffer pool (MALLOC_GLUE_POOL=<bytes>)
+ *
+ * O_DIRECT style code allocates and frees page aligned buffers of a
+ * few sizes all the time. valloc(), pvalloc() and the aligned calls
+ * with at least page alignment (the pool route) get a power of two
+ * number of pages, up to page << (POOL_CLASSES - 1), and free() puts
+ * them into a small cache of the thread, then a global one instead
+ * of back to the backend.
+ * The blocks are the backend's, aligned to their own size so they
+ * fit any alignment up to that. Handed out blocks are tracked in
+ * pool_owned, realloc() turns them into normal blocks.
+ *
+ * At most config.pool bytes are cached, anything above goes back to
+ * the backend and so does the global cache on release_run().
+ * Exiting threads move their cache to the global one.
+ */
+#define POOL_CLASSES 9
+#define POOL_THREAD_CACHE 4
+#define POOL_GLOBAL_CACHE 256
+#define POOL_MAX_BLOCKS 8192
+
+static __thread void* tls_pool[POOL_CLASSES][POOL_THREAD_CACHE] __attribute__((tls_model("initial-exec")));
+static __thread unsigned tls_pool_count[POOL_CLASSES] __attribute__((tls_model("initial-exec")));
+// pool_key is set for this thread, pool_thread_exit() will run
+static __thread bool tls_pool_exit __attribute__((tls_model("initial-exec")));
+
+// protected by pool_lock
+static void* pool_global[POOL_CLASSES][POOL_GLOBAL_CACHE];
+static unsigned pool_global_count[POOL_CLASSES];
+// bytes in all caches
+static atomic_size_t pool_cached = 0;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_uintptr_t pool_slots[2 * POOL_MAX_BLOCKS];
+static ptrset pool_owned = PTRSET_INIT(pool_slots);
+
+/**
+ * Smallest class for size, -1 if it's too big
+ */
+static inline int pool_class(size_t size) {
+    size_t pages = (size + large_page - 1) / large_page;
+    int class = pages <= 1 ? 0 : (int)(sizeof(size_t) * 8) - __builtin_clzl(pages - 1);
+    return class < POOL_CLASSES ? class : -1;
+}
+
+/**
+ * Put a block into the global cache or give it back
+ */
+static void pool_put_global(void* ptr, int class) {
+    pthread_mutex_lock(&pool_lock);
+    if (pool_global_count[class] < POOL_GLOBAL_CACHE) {
+        pool_global[class][pool_global_count[class]++] = ptr;
+        ptr = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (ptr) {
+        atomic_fetch_sub_explicit(&pool_cached, large_page << class, memory_order_relaxed);
+        lut.free(ptr);
+    }
+}
+
+static void pool_thread_exit(void* arg) {
+    (void)arg;
+    for (int class = 0; class < POOL_CLASSES; class++) {
+        while (tls_pool_count[class]) {
+            pool_put_global(tls_pool[class][--tls_pool_count[class]], class);
+        }
+    }
+}
+
+static void pool_key_create(void) {
+    pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+static void* pool_alloc(size_t size, size_t alignment) {
+    int class = pool_class(size > alignment ? size : alignment);
+    // scoped blocks would go away with the scope's heap,
+    // bad alignments are the backend's to reject
+    if (class < 0 || (alignment & (alignment - 1)) || tls_scope_depth || lazy_active()) {
+        return NULL;
+    }
+    size_t class_size = large_page << class;
+    void* ptr = NULL;
+    if (tls_pool_count[class]) {
+        ptr = tls_pool[class][--tls_pool_count[class]];
+    } else {
+        pthread_mutex_lock(&pool_lock);
+        if (pool_global_count[class]) {
+            ptr = pool_global[class][--pool_global_count[class]];
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (ptr) {
+        atomic_fetch_sub_explicit(&pool_cached, class_size, memory_order_relaxed);
+    } else {
+        numa_check();
+        if (lut.posix_memalign(&ptr, class_size, class_size) != 0) {
+            return NULL;
+        }
+#ifndef NDEBUG
+        fprintf(stderr, "Pool block %p: %zu bytes\n", ptr, class_size);
+#endif
+    }
+    // with the set full it's just a backend block
+    ptrset_insert(&pool_owned, ptr);
+    return ptr;
+}
+
+static inline bool pool_is_ours(const void* ptr) {
+    return ((uintptr_t)ptr & (large_page - 1)) == 0 && ptr && ptrset_contains(&pool_owned, ptr);
+}
+
+/**
+ * Recycle ptr if it's a pool block
+ */
+static bool pool_free(void* ptr) {
+    if (((uintptr_t)ptr & (large_page - 1)) != 0 || !ptr || !ptrset_remove(&pool_owned, ptr)) {
+        return false;
+    }
+    // the class is the biggest one that fits the block, which may be
+    // twice that or more (aligned over-allocation), and ptr is aligned
+    // for: a block in a class has to meet the class' alignment
+    size_t pages = lut.malloc_usable_size(ptr) / large_page;
+    if (!pages) {
+        lut.free(ptr);
+        return true;
+    }
+    int class = (int)(sizeof(size_t) * 8) - 1 - __builtin_clzl(pages);
+    int aligned = __builtin_ctzl((uintptr_t)ptr / large_page);
+    if (class > aligned) {
+        class = aligned;
+    }
+    if (class >= POOL_CLASSES) {
+        class = POOL_CLASSES - 1;
+    }
+    size_t class_size = large_page << class;
+    if (atomic_fetch_add_explicit(&pool_cached, class_size, memory_order_relaxed) + class_size > config.pool) {
+        atomic_fetch_sub_explicit(&pool_cached, class_size, memory_order_relaxed);
+        lut.free(ptr);
+        return true;
+    }
+    if (tls_pool_count[class] < POOL_THREAD_CACHE) {
+        if (!tls_pool_exit) {
+            pthread_once(&pool_key_once, pool_key_create);
+            pthread_setspecific(pool_key, &tls_pool_exit);
+            tls_pool_exit = true;
+        }
+        tls_pool[class][tls_pool_count[class]++] = ptr;
+        return true;
+    }
+    pool_put_global(ptr, class);
+    return true;
+}
+
+/**
+ * ptr is about to be realloc()ed, it's not a pool block anymore
+ */
+static inline void pool_forget(void* ptr) {
+    if (((uintptr_t)ptr & (large_page - 1)) == 0 && ptr) {
+        ptrset_remove(&pool_owned, ptr);
+    }
+}
+
+/**
+ * Give the global cache back to the backend
+ * Returns the bytes released
+ */
+static size_t pool_drain(size_t wanted) {
+    size_t released = 0;
+    pthread_mutex_lock(&pool_lock);
+    // biggest first
+    for (int class = POOL_CLASSES - 1; class >= 0 && released < wanted; class--) {
+        while (pool_global_count[class] && released < wanted) {
+            lut.free(pool_global[class][--pool_global_count[class]]);
+            released += large_page << class;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    atomic_fetch_sub_explicit(&pool_cached, released, memory_order_relaxed);
+    return released;
+}
+
+/**
+ * Only valid alignments are routed, the backend rejects
+ * (or for memalign() rounds up) the others as it always did
+ */
+static inline bool aligned_valid(size_t alignment) {
+    return alignment && !(alignment & (alignment - 1));
+}
+
+/**
+ * Routes of the aligned calls that don't end in the backend
+ */
+static inline void* aligned_routed(enum route route, size_t size, size_t alignment) {
+    if (route == ROUTE_POOL) {
+        return pool_alloc(size, alignment);
+    }
+    if (route == ROUTE_COLOUR) {
+        return colour_alloc(size, alignment);
+    }
+    return large_aligned(route, size, alignment);
+}
+
+/**
+ * Release callbacks (malloc_glue_release_register())
+ *
+ * Applications register callbacks that shrink their caches, they're
+ * run by priority (lowest first) until roughly the wanted amount is
+ * released:
+ *   - when an allocation in the wrappers fails, before retrying it
+ *   - on high/critical memory pressure (MALLOC_GLUE_PRESSURE=1)
+ * Callbacks run with release_lock held, one run at a time.
+ * There's no allocation in here, it runs when malloc doesn't work.
+ */
+#define RELEASE_MAX_CALLBACKS 64
+
+typedef struct release_callback {
+    int id;
+    int priority;
+    // estimate of what the callback can still release
+    size_t size;
+    malloc_glue_release_fn fn;
+    void* arg;
+} release_callback;
+
+// sorted by priority
+static release_callback release_callbacks[RELEASE_MAX_CALLBACKS];
+static atomic_int release_count = 0;
+static int release_next_id = 1;
+// set while this thread runs callbacks, their failing mallocs don't recurse
+static __thread bool tls_releasing = false;
+
+/**
+ * Run callbacks until wanted bytes are released
+ * Returns the bytes they reported
+ */
+static size_t release_run(size_t wanted) {
+    // our own cache goes first
+    size_t released = config.pool ? pool_drain(wanted) : 0;
+    if (released >= wanted || atomic_load_explicit(&release_count, memory_order_relaxed) == 0 || tls_releasing) {
+        return released;
+    }
+    tls_releasing = true;
+    pthread_mutex_lock(&release_lock);
+    for (int i = 0; i < release_count && released < wanted; i++) {
+        release_callback* cb = &release_callbacks[i];
+        if (cb->size == 0) {
+            continue;
+        }
+        size_t ret = cb->fn(wanted - released, cb->arg);
+        cb->size = ret < cb->size ? cb->size - ret : 0;
+        released += ret;
+#ifndef NDEBUG
+        fprintf(stderr, "Release callback %d -> %zu bytes\n", cb->id, ret);
+#endif
+    }
+    pthread_mutex_unlock(&release_lock);
+    tls_releasing = false;
+    return released;
+}
+
+/**
+ * An allocation of size failed
+ * Returns true if callbacks released something and retrying makes sense
+ */
+static bool release_retry(size_t size) {
+    return release_run(size ? size : 1) > 0;
+}
+
+/**
+ * Memory pressure (MALLOC_GLUE_PRESSURE=1)
+ *
+ * Checked by the maintenance thread every tick. The level is the
+ * highest one reached by either
+ *   - memory.current / memory.max of our cgroup (or the ancestor with
+ *     the smallest limit), MALLOC_GLUE_PRESSURE_LIMITS percent
+ *   - "some avg10" of /proc/pressure/memory,
+ *     MALLOC_GLUE_PRESSURE_PSI_LIMITS percent
+ * and the glue escalates with it:
+ *   moderate  purge freed memory immediately (purge delay 0)
+ *   high      release callbacks for what's above the moderate
+ *             limit, then collect everything, repeated every second
+ *   critical  all release callbacks, then collect everything
+ * MALLOC_GLUE_PRESSURE_CGROUP / MALLOC_GLUE_PRESSURE_PSI point it at
+ * other files, e.g. to simulate pressure.
+ */
+enum pressure_level {
+    PRESSURE_NONE,
+    PRESSURE_MODERATE,
+    PRESSURE_HIGH,
+    PRESSURE_CRITICAL
+};
+
+#define PRESSURE_REPEAT_NS 1000000000ull
+
+static char pressure_cgroup[4096];
+static atomic_int pressure_level = PRESSURE_NONE;
+static long pressure_saved_delay;
+static uint64_t pressure_last_collect;
+// bytes above the moderate limit, SIZE_MAX if we can't tell
+static size_t pressure_excess;
+
+/**
+ * Read a memory.* file of dir, SIZE_MAX for "max" or errors
+ */
+static size_t cgroup_read(const char* dir, const char* name) {
+    char path[4096 + 32];
+    char buf[64];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (read_file(path, buf, sizeof(buf)) <= 0 || buf[0] < '0' || buf[0] > '9') {
+        return SIZE_MAX;
+    }
+    return strtoull(buf, NULL, 10);
+}
+
+/**
+ * Find the cgroup whose limit we'll run into first
+ */
+static void pressure_setup(void) {
+    if (config.pressure_cgroup) {
+        snprintf(pressure_cgroup, sizeof(pressure_cgroup), "%s", config.pressure_cgroup);
+        return;
+    }
+
+    policy_process proc = { 0 };
+    const char* path = policy_process_get(&proc, POLICY_MATCH_CGROUP);
+    if (!path) {
+        return;
+    }
+    char dir[sizeof(pressure_cgroup)];
+    snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s", strcmp(path, "/") == 0 ? "" : path);
+
+    size_t best = SIZE_MAX;
+    for (;;) {
+        size_t max = cgroup_read(dir, "memory.max");
+        if (max < best) {
+            best = max;
+            memcpy(pressure_cgroup, dir, sizeof(dir));
+        }
+        char* slash = strrchr(dir, '/');
+        if (!slash || slash - dir <= (ptrdiff_t)strlen("/sys/fs/cgroup")) {
+            break;
+        }
+        *slash = '\0';
+    }
+#ifndef NDEBUG
+    fprintf(stderr, "Pressure: watching %s\n", pressure_cgroup[0] ? pressure_cgroup : "PSI only");
+#endif
+}
+
+static int level_of(double value, const unsigned limits[3]) {
+    int level = PRESSURE_NONE;
+    for (int i = 0; i < 3; i++) {
+        if (value >= limits[i]) {
+            level = PRESSURE_MODERATE + i;
+        }
+    }
+    return level;
+}
+
+static int pressure_read(void) {
+    int level = PRESSURE_NONE;
+    pressure_excess = SIZE_MAX;
+    if (pressure_cgroup[0]) {
+        size_t max = cgroup_read(pressure_cgroup, "memory.max");
+        size_t current = cgroup_read(pressure_cgroup, "memory.current");
+        if (max != SIZE_MAX && max && current != SIZE_MAX) {
+            level = level_of((double)current * 100.0 / (double)max, config.pressure_limits);
+            size_t moderate = (size_t)((double)max * config.pressure_limits[0] / 100.0);
+            pressure_excess = current > moderate ? current - moderate : 0;
+        }
+    }
+
+    char buf[256];
+    const char* psi = config.pressure_psi ? config.pressure_psi : "/proc/pressure/memory";
+    if (read_file(psi, buf, sizeof(buf)) > 0) {
+        // some avg10=1.23 avg60=... avg300=... total=...
+        const char* avg = strstr(buf, "some avg10=");
+        if (avg) {
+            int psi_level = level_of(strtod(avg + strlen("some avg10="), NULL), config.pressure_psi_limits);
+            level = psi_level > level ? psi_level : level;
+        }
+    }
+    return level;
+}
+
+/**
+ * Called every maintenance tick
+ * Returns the current level
+ */
+static int pressure_check(void) {
+    int level = pressure_read();
+    int prev = atomic_exchange(&pressure_level, level);
+    bool options = options_supported(ext.version ? ext.version() : 0) && ext.option_get;
+#ifndef NDEBUG
+    if (level != prev) {
+        fprintf(stderr, "Pressure: level %d -> %d\n", prev, level);
+    }
+#endif
+
+    if (level == PRESSURE_NONE) {
+        if (prev != PRESSURE_NONE && options) {
+            ext.option_set(MI_OPTION_PURGE_DELAY, pressure_saved_delay);
+        }
+        return level;
+    }
+    if (prev == PRESSURE_NONE && options) {
+        pressure_saved_delay = ext.option_get(MI_OPTION_PURGE_DELAY);
+        ext.option_set(MI_OPTION_PURGE_DELAY, 0);
+    }
+
+    uint64_t now = now_ns();
+    if (level >= PRESSURE_HIGH && (level > prev || now - pressure_last_collect >= PRESSURE_REPEAT_NS)) {
+        // PSI alone doesn't say how much, ask for everything
+        release_run(level == PRESSURE_CRITICAL || pressure_excess == 0 ? SIZE_MAX : pressure_excess);
+        ext.collect(true);
+        pressure_last_collect = now;
+    } else if (level == PRESSURE_MODERATE) {
+        // get the now immediate purges done
+        ext.collect(false);
+    }
+    return level;
+}
+
+/**
+ * Maintenance thread (MALLOC_GLUE_MAINT=1)
+ *
+ * The backend only purges and reclaims abandoned thread heaps when
+ * application threads happen to call into it. This thread wakes up
+ * every MALLOC_GLUE_MAINT_MS and looks at how many calls went through
+ * the wrappers since the last time:
+ *
+ *   busy (>= MALLOC_GLUE_MAINT_BUSY calls/s)  stay out of the way, back off
+ *                                             up to 8x the interval
+ *   otherwise                                 mi_collect(false): reclaim
+ *                                             abandoned heaps, purge what
+ *                                             is past the purge delay
+ *   no calls for MALLOC_GLUE_MAINT_IDLE_MS    mi_collect(true) once
+ *
+ * MALLOC_GLUE_MAINT_PURGE_MS sets the backend's purge delay,
+ * i.e. how long freed pages stay committed.
+ *
+ * MALLOC_GLUE_PRESSURE=1 runs the thread as well, the pressure
+ * handling replaces the normal work while there is any.
+ */
+#define MAINT_MAX_BACKOFF 8
+
+static size_t maint_calls(void) {
+    return atomic_load_explicit(&stats.allocs, memory_order_relaxed)
+        + atomic_load_explicit(&stats.frees, memory_order_relaxed)
+        + atomic_load_explicit(&stats.reallocs, memory_order_relaxed);
+}
+
+static void* maint_thread(void* arg) {
+    (void)arg;
+    if (config.pressure) {
+        pressure_setup();
+    }
+    size_t last = maint_calls();
+    uint64_t idle_since = now_ns();
+    unsigned backoff = 1;
+    bool collected = false;
 
-    // finally bulk update
-    lut.malloc = malloc;
-    lut.calloc = calloc;
-    lut.realloc = realloc;
-    lut.free = free;
-    lut.strdup = strdup;
-    lut.strndup = strndup;
-    lut.realpath = realpath;
-    lut.reallocf = reallocf;
-    lut.malloc_size = malloc_size;
-    lut.malloc_usable_size = malloc_usable_size;
-    lut.malloc_good_size = malloc_good_size;
-    lut.cfree = cfree;
-    lut.valloc = valloc;
-    lut.pvalloc = pvalloc;
-    lut.reallocarray = reallocarray;
-    lut.reallocarr = reallocarr;
-    lut.memalign = memalign;
-    lut.aligned_alloc = aligned_alloc;
-    lut.posix_memalign = posix_memalign;
-    lut._posix_memalign = _posix_memalign;
+    for (;;) {
+        uint64_t interval_ms = (uint64_t)config.maint_ms * backoff;
+        struct timespec interval = {
+            .tv_sec = (time_t)(interval_ms / 1000),
+            .tv_nsec = (long)(interval_ms % 1000) * 1000000
+        };
+        nanosleep(&interval, NULL);
+        if (lazy_active() || !ext.collect) {
+            continue;
+        }
+        if (config.pressure && pressure_check() != PRESSURE_NONE) {
+            backoff = 1;
+            continue;
+        }
+        if (!config.maint) {
+            continue;
+        }
 
+        size_t calls = maint_calls();
+        size_t delta = calls - last;
+        last = calls;
+        uint64_t now = now_ns();
+
+        if ((double)delta * 1000.0 / (double)interval_ms >= (double)config.maint_busy) {
+            backoff = backoff * 2 > MAINT_MAX_BACKOFF ? MAINT_MAX_BACKOFF : backoff * 2;
+            idle_since = now;
+            collected = false;
+            continue;
+        }
+        backoff = 1;
+
+        if (delta) {
+            idle_since = now;
+            collected = false;
+        } else if (collected) {
+            continue;
+        } else if (now - idle_since >= (uint64_t)config.maint_idle_ms * 1000000ull) {
 #ifndef NDEBUG
-    fprintf(stderr, "Finished initialisation\n");
+            fprintf(stderr, "Maintenance: idle, collecting everything\n");
 #endif
+            ext.collect(true);
+            collected = true;
+            continue;
+        }
+        ext.collect(false);
+    }
+    return NULL;
+}
 
-    initialized = true;
-    pthread_mutex_unlock(&mutex);
+static void maint_start(void) {
+    if (!(config.maint || config.pressure) || maint_running) {
+        return;
+    }
+    // keep the application's signals away from our thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, maint_thread, NULL) == 0) {
+        pthread_setname_np(thread, "malloc-glue");
+        maint_running = true;
+    } else {
+        fprintf(stderr, "malloc-glue: failed to start the maintenance thread\n");
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
 /**
- * Check if a symbol is defined (not NULL)
- * if it isn't abort
+ * Start the glue's threads, those that are configured and not running
  */
-static void check_defined(void* symbol, const char* name) {
-    if (symbol == NULL) {
-        fprintf(stderr, "%s() is not defined\n", name);
-        abort();
-    }
+static void threads_start(void) {
+    prewarm_start();
+    maint_start();
+    prefault_start();
 }
 
+/**
+ * The glue's only constructor, runs once it's loaded.
+ * The fork() handlers come first, they have to exist before
+ * any thread can fork(). It can't happen inside init() because
+ * pthread_atfork() and fork() share a lock and we would deadlock
+ * against a concurrent fork().
+ * The threads don't start from init() either, it may run
+ * with loader locks held which pthread_create() needs as well.
+ */
+__attribute__((constructor))
+static void glue_start(void) {
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+    init();
+    threads_start();
+}
 
 // All the wrappers
 
@@ -297,25 +2868,99 @@ static void check_defined(void* symbol, const char* name) {
 void* malloc(size_t size) {
     init();
     check_defined(lut.malloc, "malloc");
-    void* ret = lut.malloc(size);
+    count_alloc(size);
+    enum route route = route_for(&routes, size, 0);
+    if (large_route(route)) {
+        void* ret = large_alloc(size);
+        if (ret) {
+            return prefault_new(ret, size);
+        }
+    } else if (route == ROUTE_COLOUR) {
+        void* ret = colour_alloc(size, 0);
+        if (ret) {
+            return prefault_new(ret, size);
+        }
+    }
+    if (lazy_active()) {
+        return lazy_track(libc_lut.malloc(size), size);
+    }
+    numa_check();
+    void* ret = route == ROUTE_THP ? thp_malloc(size) : lut.malloc(size);
+    if (!ret && numa_retry()) {
+        ret = lut.malloc(size);
+    }
+    if (!ret && release_retry(size)) {
+        ret = lut.malloc(size);
+    }
 #ifndef NDEBUG
     fprintf(stderr, "malloc(%p) -> %p\n", lut.malloc, ret);
 #endif
-    return ret;
+    return prefault_new(ret, size);
 }
 
 // malloc(3)
 void* calloc(size_t n, size_t size) {
     init();
     check_defined(lut.calloc, "calloc");
-    return lut.calloc(n, size);
+    count_alloc(n * size);
+    size_t total;
+    bool overflow = __builtin_mul_overflow(n, size, &total);
+    enum route route = overflow ? ROUTE_BACKEND : route_for(&routes, total, 0);
+    if (large_route(route)) {
+        // fresh mappings are zeroed already
+        void* ret = large_alloc(total);
+        if (ret) {
+            return prefault_new(ret, total);
+        }
+    } else if (route == ROUTE_COLOUR) {
+        void* ret = colour_alloc(total, 0);
+        if (ret) {
+            return prefault_new(memset(ret, 0, total), total);
+        }
+    }
+    if (lazy_active()) {
+        return lazy_track(libc_lut.calloc(n, size), total);
+    }
+    numa_check();
+    void* ret = lut.calloc(n, size);
+    if (!ret && numa_retry()) {
+        ret = lut.calloc(n, size);
+    }
+    if (!ret && !overflow && release_retry(total)) {
+        ret = lut.calloc(n, size);
+    }
+    if (ret && route == ROUTE_THP) {
+        thp_advise(ret, total);
+    }
+    return ret ? prefault_new(ret, total) : NULL;
 }
 
 // malloc(3)
 void* realloc(void *_Nullable ptr, size_t size) {
     init();
     check_defined(lut.realloc, "realloc");
-    return lut.realloc(ptr, size);
+    count_realloc(size);
+    prefault_drop(ptr);
+    void* ret;
+    if (large_realloc(ptr, size, &ret) || colour_realloc(ptr, size, &ret)) {
+        return ret;
+    }
+    if (lazy_active() || (ptr && lazy_is_libc(ptr))) {
+        return lazy_realloc(ptr, size);
+    }
+    pool_forget(ptr);
+    numa_check();
+    ret = lut.realloc(ptr, size);
+    if (!ret && size && numa_retry()) {
+        ret = lut.realloc(ptr, size);
+    }
+    if (!ret && size && release_retry(size)) {
+        ret = lut.realloc(ptr, size);
+    }
+    if (thp_wanted(size)) {
+        thp_advise(ret, size);
+    }
+    return ret;
 }
 
 // malloc(3)
@@ -325,6 +2970,16 @@ void free(void *_Nullable ptr) {
 #endif
     init();
     check_defined(lut.free, "free");
+    count_free();
+    prefault_drop(ptr);
+    if (ptr && ptrset_remove(&lazy_owned, ptr)) {
+        libc_lut.free(ptr);
+        return;
+    }
+    // our own blocks first, the scope's heap only knows the backend's
+    if (large_free(ptr) || pool_free(ptr) || colour_free(ptr) || scope_owned(ptr)) {
+        return;
+    }
     lut.free(ptr);
 }
 
@@ -332,33 +2987,76 @@ void free(void *_Nullable ptr) {
 char *strdup(const char *s) {
     init();
     check_defined(lut.strdup, "strdup");
-    return lut.strdup(s);
+    count_alloc(0);
+    numa_check();
+    char* ret = lut.strdup(s);
+    if (!ret && numa_retry()) {
+        ret = lut.strdup(s);
+    }
+    if (!ret && release_retry(strlen(s) + 1)) {
+        ret = lut.strdup(s);
+    }
+    return ret;
 }
 
 // strdup(3)
 char *strndup(const char *s, size_t n) {
     init();
     check_defined(lut.strndup, "strndup");
-    return lut.strndup(s, n);
+    count_alloc(0);
+    numa_check();
+    char* ret = lut.strndup(s, n);
+    if (!ret && numa_retry()) {
+        ret = lut.strndup(s, n);
+    }
+    if (!ret && release_retry(strnlen(s, n) + 1)) {
+        ret = lut.strndup(s, n);
+    }
+    return ret;
 }
 
 // realpath(3)
 char *realpath(const char *path, char *resolved_path) {
     init();
     check_defined(lut.realpath, "realpath");
-    return lut.realpath(path, resolved_path);
+    if (resolved_path) {
+        return lut.realpath(path, resolved_path);
+    }
+    // only allocating calls can run out, and only then retrying helps
+    numa_check();
+    char* ret = lut.realpath(path, NULL);
+    if (!ret && errno == ENOMEM && numa_retry()) {
+        ret = lut.realpath(path, NULL);
+    }
+    if (!ret && errno == ENOMEM && release_retry(PATH_MAX)) {
+        ret = lut.realpath(path, NULL);
+    }
+    return ret;
 }
 
 // reallocf(3bsd)
+// realloc() that frees ptr when it fails, built on our realloc()
+// so it gets the same lazy, large and retry handling
 void *reallocf(void *ptr, size_t size) {
-    init();
-    check_defined(lut.reallocf, "reallocf");
-    return lut.reallocf(ptr, size);
+    void* ret = realloc(ptr, size);
+    if (!ret && size) {
+        free(ptr);
+    }
+    return ret;
 }
 
 // malloc_usable_size(3)
 size_t malloc_size(void *ptr) {
     init();
+    if (ptr && lazy_is_libc(ptr)) {
+        return libc_lut.malloc_usable_size(ptr);
+    }
+    if (large_is_ours(ptr)) {
+        return large_usable(ptr);
+    }
+    if (colour_is_ours(ptr)) {
+        return colour_usable(ptr);
+    }
     check_defined(lut.malloc_size, "malloc_size");
     return lut.malloc_size(ptr);
 }
@@ -367,6 +3065,15 @@ size_t malloc_size(void *ptr) {
 size_t malloc_usable_size(void *_Nullable ptr) {
     init();
     check_defined(lut.malloc_usable_size, "malloc_usable_size");
+    if (ptr && lazy_is_libc(ptr)) {
+        return libc_lut.malloc_usable_size(ptr);
+    }
+    if (large_is_ours(ptr)) {
+        return large_usable(ptr);
+    }
+    if (colour_is_ours(ptr)) {
+        return colour_usable(ptr);
+    }
     return lut.malloc_usable_size(ptr);
 }
 
@@ -381,6 +3088,15 @@ size_t malloc_good_size(size_t size) {
 void cfree(void *ptr) {
     init();
     check_defined(lut.cfree, "cfree");
+    count_free();
+    prefault_drop(ptr);
+    if (ptr && ptrset_remove(&lazy_owned, ptr)) {
+        libc_lut.free(ptr);
+        return;
+    }
+    if (large_free(ptr) || pool_free(ptr) || colour_free(ptr) || scope_owned(ptr)) {
+        return;
+    }
     return lut.cfree(ptr);
 }
 
@@ -388,56 +3104,530 @@ void cfree(void *ptr) {
 [[deprecated]] void *valloc(size_t size) {
     init();
     check_defined(lut.valloc, "valloc");
-    return lut.valloc(size);
+    count_alloc(size);
+    void* ret = aligned_routed(route_for(&routes, size, large_page), size, large_page);
+    if (ret) {
+        return ret;
+    }
+    if (lazy_active()) {
+        return lazy_track(libc_lut.valloc(size), size);
+    }
+    numa_check();
+    ret = lut.valloc(size);
+    if (!ret && numa_retry()) {
+        ret = lut.valloc(size);
+    }
+    if (!ret && release_retry(size)) {
+        ret = lut.valloc(size);
+    }
+    return ret;
 }
 
 // posix_memalign(3)
 [[deprecated]] void *pvalloc(size_t size) {
     init();
     check_defined(lut.pvalloc, "pvalloc");
-    return lut.pvalloc(size);
+    count_alloc(size);
+    void* ret = aligned_routed(route_for(&routes, size, large_page), size, large_page);
+    if (ret) {
+        return ret;
+    }
+    if (lazy_active()) {
+        return lazy_track(libc_lut.pvalloc(size), size);
+    }
+    numa_check();
+    ret = lut.pvalloc(size);
+    if (!ret && numa_retry()) {
+        ret = lut.pvalloc(size);
+    }
+    if (!ret && release_retry(size)) {
+        ret = lut.pvalloc(size);
+    }
+    return ret;
 }
 
 // malloc(3)
 void *reallocarray(void *_Nullable ptr, size_t n, size_t size) {
     init();
     check_defined(lut.reallocarray, "reallocarray");
-    return lut.reallocarray(ptr, n, size);
+    count_realloc(n * size);
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    prefault_drop(ptr);
+    void* ret;
+    if (large_realloc(ptr, total, &ret) || colour_realloc(ptr, total, &ret)) {
+        return ret;
+    }
+    if (lazy_active() || (ptr && lazy_is_libc(ptr))) {
+        return lazy_realloc(ptr, total);
+    }
+    pool_forget(ptr);
+    numa_check();
+    ret = lut.reallocarray(ptr, n, size);
+    if (!ret && total && numa_retry()) {
+        ret = lut.reallocarray(ptr, n, size);
+    }
+    if (!ret && total && release_retry(total)) {
+        ret = lut.reallocarray(ptr, n, size);
+    }
+    if (thp_wanted(total)) {
+        thp_advise(ret, total);
+    }
+    return ret;
 }
 
 // reallocarr(3)
 int reallocarr(void *_Nullable ptr, size_t n, size_t size) {
     init();
+    count_realloc(n * size);
+    // ptr is really a void** here
+    void* old = ptr ? *(void**)ptr : NULL;
+    prefault_drop(old);
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        return EOVERFLOW;
+    }
+    // large and coloured blocks aren't the backend's, and libc has no
+    // reallocarr(), lazy mode does it by hand
+    void* ret;
+    bool done = large_realloc(old, total, &ret) || colour_realloc(old, total, &ret);
+    if (!done && (lazy_active() || (old && lazy_is_libc(old)))) {
+        ret = lazy_realloc(old, total);
+        done = true;
+    }
+    if (done) {
+        if (!ret && total) {
+            return ENOMEM;
+        }
+        *(void**)ptr = ret;
+        return 0;
+    }
     check_defined(lut.reallocarr, "reallocarr");
-    return lut.reallocarr(ptr, n, size);
+    pool_forget(old);
+    numa_check();
+    int err = lut.reallocarr(ptr, n, size);
+    if (err == ENOMEM && numa_retry()) {
+        err = lut.reallocarr(ptr, n, size);
+    }
+    if (err == ENOMEM && release_retry(total)) {
+        err = lut.reallocarr(ptr, n, size);
+    }
+    return err;
 }
 
 // posix_memalign(3)
 [[deprecated]] void *memalign(size_t alignment, size_t size) {
     init();
     check_defined(lut.memalign, "memalign");
-    return lut.memalign(alignment, size);
+    count_alloc(size);
+    enum route route = aligned_valid(alignment) ? route_for(&routes, size, alignment) : ROUTE_BACKEND;
+    void* ret = aligned_routed(route, size, alignment);
+    if (ret) {
+        return ret;
+    }
+    if (lazy_active()) {
+        return lazy_track(libc_lut.memalign(alignment, size), size);
+    }
+    numa_check();
+    ret = lut.memalign(alignment, size);
+    if (!ret && numa_retry()) {
+        ret = lut.memalign(alignment, size);
+    }
+    if (!ret && release_retry(size)) {
+        ret = lut.memalign(alignment, size);
+    }
+    if (route == ROUTE_THP) {
+        thp_advise(ret, size);
+    }
+    return ret;
 }
 
 // posix_memalign(3)
 void *aligned_alloc(size_t alignment, size_t size) {
     init();
     check_defined(lut.aligned_alloc, "aligned_alloc");
-    return lut.aligned_alloc(alignment, size);
+    count_alloc(size);
+    enum route route = aligned_valid(alignment) ? route_for(&routes, size, alignment) : ROUTE_BACKEND;
+    void* ret = aligned_routed(route, size, alignment);
+    if (ret) {
+        return ret;
+    }
+    if (lazy_active()) {
+        return lazy_track(libc_lut.aligned_alloc(alignment, size), size);
+    }
+    numa_check();
+    ret = lut.aligned_alloc(alignment, size);
+    if (!ret && numa_retry()) {
+        ret = lut.aligned_alloc(alignment, size);
+    }
+    if (!ret && release_retry(size)) {
+        ret = lut.aligned_alloc(alignment, size);
+    }
+    if (route == ROUTE_THP) {
+        thp_advise(ret, size);
+    }
+    return ret;
 }
 
 // posix_memalign(3)
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
     init();
     check_defined(lut.posix_memalign, "posix_memalign");
-    return lut.posix_memalign(memptr, alignment, size);
+    if (!aligned_valid(alignment) || alignment % sizeof(void*)) {
+        return EINVAL;
+    }
+    count_alloc(size);
+    enum route route = route_for(&routes, size, alignment);
+    void* routed = aligned_routed(route, size, alignment);
+    if (routed) {
+        *memptr = routed;
+        return 0;
+    }
+    if (lazy_active()) {
+        int ret = libc_lut.posix_memalign(memptr, alignment, size);
+        if (ret == 0) {
+            lazy_track(*memptr, size);
+        }
+        return ret;
+    }
+    numa_check();
+    int ret = lut.posix_memalign(memptr, alignment, size);
+    if (ret == ENOMEM && numa_retry()) {
+        ret = lut.posix_memalign(memptr, alignment, size);
+    }
+    if (ret == ENOMEM && release_retry(size)) {
+        ret = lut.posix_memalign(memptr, alignment, size);
+    }
+    if (ret == 0 && route == ROUTE_THP) {
+        thp_advise(*memptr, size);
+    }
+    return ret;
 }
 
 // posix_memalign(3)
 int _posix_memalign(void **memptr, size_t alignment, size_t size) {
     init();
     check_defined(lut._posix_memalign, "_posix_memalign");
-    return lut._posix_memalign(memptr, alignment, size);
+    if (!aligned_valid(alignment) || alignment % sizeof(void*)) {
+        return EINVAL;
+    }
+    count_alloc(size);
+    enum route route = route_for(&routes, size, alignment);
+    void* routed = aligned_routed(route, size, alignment);
+    if (routed) {
+        *memptr = routed;
+        return 0;
+    }
+    if (lazy_active()) {
+        int ret = libc_lut._posix_memalign(memptr, alignment, size);
+        if (ret == 0) {
+            lazy_track(*memptr, size);
+        }
+        return ret;
+    }
+    numa_check();
+    int ret = lut._posix_memalign(memptr, alignment, size);
+    if (ret == ENOMEM && numa_retry()) {
+        ret = lut._posix_memalign(memptr, alignment, size);
+    }
+    if (ret == ENOMEM && release_retry(size)) {
+        ret = lut._posix_memalign(memptr, alignment, size);
+    }
+    if (ret == 0 && route == ROUTE_THP) {
+        thp_advise(*memptr, size);
+    }
+    return ret;
+}
+
+// Glue API (see mimalloc-glue.h)
+
+const char* malloc_glue_backend(void) {
+    init();
+    return backend_name;
+}
+
+size_t malloc_glue_committed_bytes(void) {
+    init();
+    if (!ext.process_info) {
+        return MALLOC_GLUE_UNKNOWN;
+    }
+
+    size_t elapsed, utime, stime, current_rss, peak_rss;
+    size_t current_commit, peak_commit, page_faults;
+    ext.process_info(&elapsed, &utime, &stime, &current_rss, &peak_rss,
+                     &current_commit, &peak_commit, &page_faults);
+    return current_commit;
+}
+
+void malloc_glue_get_stats(malloc_glue_stats* out) {
+    init();
+    if (counting) {
+        flush_stats();
+    }
+    out->allocs = atomic_load(&stats.allocs);
+    out->frees = atomic_load(&stats.frees);
+    out->reallocs = atomic_load(&stats.reallocs);
+    out->bytes = atomic_load(&stats.bytes);
+}
+
+size_t malloc_glue_huge_bytes(void) {
+    return huge_backed_bytes();
+}
+
+int malloc_glue_pressure_level(void) {
+    return atomic_load(&pressure_level);
+}
+
+int malloc_glue_release_register(malloc_glue_release_fn fn, void* arg, int priority, size_t size) {
+    if (!fn || tls_releasing) {
+        return -1;
+    }
+    pthread_mutex_lock(&release_lock);
+    int count = atomic_load(&release_count);
+    if (count == RELEASE_MAX_CALLBACKS) {
+        pthread_mutex_unlock(&release_lock);
+        return -1;
+    }
+    // after the ones with the same priority
+    int i = count;
+    while (i > 0 && release_callbacks[i - 1].priority > priority) {
+        release_callbacks[i] = release_callbacks[i - 1];
+        i--;
+    }
+    int id = release_next_id++;
+    release_callbacks[i] = (release_callback){ id, priority, size, fn, arg };
+    atomic_store(&release_count, count + 1);
+    pthread_mutex_unlock(&release_lock);
+    return id;
+}
+
+int malloc_glue_release_update(int id, size_t size) {
+    if (tls_releasing) {
+        // we hold the lock already
+        for (int i = 0; i < release_count; i++) {
+            if (release_callbacks[i].id == id) {
+                release_callbacks[i].size = size;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    pthread_mutex_lock(&release_lock);
+    int ret = -1;
+    for (int i = 0; i < release_count; i++) {
+        if (release_callbacks[i].id == id) {
+            release_callbacks[i].size = size;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&release_lock);
+    return ret;
+}
+
+int malloc_glue_release_unregister(int id) {
+    if (tls_releasing) {
+        return -1;
+    }
+    pthread_mutex_lock(&release_lock);
+    int count = atomic_load(&release_count);
+    int ret = -1;
+    for (int i = 0; i < count; i++) {
+        if (release_callbacks[i].id == id) {
+            memmove(&release_callbacks[i], &release_callbacks[i + 1], (size_t)(count - i - 1) * sizeof(release_callback));
+            atomic_store(&release_count, count - 1);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&release_lock);
+    return ret;
+}
+
+/**
+ * The heap functions need the backend, don't wait for the lazy switch
+ */
+static bool backend_ready(void) {
+    init();
+    if (lazy_active()) {
+        lazy_switch();
+    }
+    return !lazy_active();
+}
+
+int malloc_glue_scope_begin(void) {
+    if (!backend_ready() || !ext.heap_new || !ext.heap_destroy || !ext.heap_set_default ||
+        !ext.heap_contains_block || tls_scope_depth == SCOPE_MAX_DEPTH) {
+        return -1;
+    }
+    void* heap = ext.heap_new();
+    if (!heap) {
+        return -1;
+    }
+    tls_scope_heaps[tls_scope_depth] = heap;
+    tls_scope_prev[tls_scope_depth] = ext.heap_set_default(heap);
+    tls_scope_depth++;
+    return 0;
+}
+
+int malloc_glue_scope_end(void) {
+    if (!tls_scope_depth) {
+        return -1;
+    }
+    tls_scope_depth--;
+    ext.heap_set_default(tls_scope_prev[tls_scope_depth]);
+    ext.heap_destroy(tls_scope_heaps[tls_scope_depth]);
+    return 0;
+}
+
+malloc_glue_heap* malloc_glue_heap_new(void) {
+    if (!backend_ready() || !ext.heap_new || !ext.heap_delete || !ext.heap_destroy ||
+        !ext.heap_malloc || !ext.heap_malloc_aligned) {
+        return NULL;
+    }
+    return ext.heap_new();
+}
+
+void malloc_glue_heap_delete(malloc_glue_heap* heap) {
+    if (heap) {
+        ext.heap_delete(heap);
+    }
+}
+
+void malloc_glue_heap_destroy(malloc_glue_heap* heap) {
+    if (heap) {
+        ext.heap_destroy(heap);
+    }
+}
+
+void* malloc_glue_heap_alloc(malloc_glue_heap* heap, size_t size, size_t alignment) {
+    if (!heap) {
+        // the wrappers, whichever backend that is
+        if (alignment <= MALLOC_GLUE_MIN_ALIGN) {
+            return malloc(size);
+        }
+        void* ret;
+        return posix_memalign(&ret, alignment, size) == 0 ? ret : NULL;
+    }
+    count_alloc(size);
+    return alignment <= MALLOC_GLUE_MIN_ALIGN ? ext.heap_malloc(heap, size) : ext.heap_malloc_aligned(heap, size, alignment);
+}
+
+void* malloc_glue_alloc_small(size_t size) {
+    init();
+    if (lazy_active() || !ext.malloc_small || size > MALLOC_GLUE_SMALL_MAX) {
+        return malloc(size);
+    }
+    count_alloc(size);
+    numa_check();
+    void* ret = ext.malloc_small(size);
+    // let malloc() do the retries
+    return ret ? ret : malloc(size);
+}
+
+size_t malloc_glue_expand(void* ptr, size_t size) {
+    if (!ptr) {
+        return 0;
+    }
+    init();
+    if (large_is_ours(ptr)) {
+        return large_expand(ptr, size);
+    }
+    // backends without an expand primitive (and libc's or coloured
+    // blocks) can still use the slack of the block
+    if (ext.expand && !lazy_is_libc(ptr) && !colour_is_ours(ptr) && !ext.expand(ptr, size)) {
+        return 0;
+    }
+    size_t usable = malloc_usable_size(ptr);
+    if (usable < size) {
+        return 0;
+    }
+    count_realloc(size);
+    return usable;
+}
+
+size_t malloc_glue_alloc_batch(size_t size, size_t n, void** out) {
+    init();
+    if (lazy_active() || route_for(&routes, size, 0) != ROUTE_BACKEND) {
+        for (size_t i = 0; i < n; i++) {
+            if (!(out[i] = malloc(size))) {
+                return i;
+            }
+        }
+        return n;
+    }
+
+    // one round of checks for all of them
+    numa_check();
+    void* (*alloc)(size_t) = ext.malloc_small && size <= MALLOC_GLUE_SMALL_MAX ? ext.malloc_small : lut.malloc;
+    size_t i;
+    // malloc() counts the ones it serves itself
+    size_t fast = 0;
+    for (i = 0; i < n; i++) {
+        if ((out[i] = alloc(size))) {
+            fast++;
+        } else if (!(out[i] = malloc(size))) {
+            // even malloc()'s retries didn't help
+            break;
+        }
+    }
+    count_batch(fast, 0, fast * size);
+    return i;
+}
+
+void malloc_glue_free_batch(void** ptrs, size_t n) {
+    init();
+    check_defined(lut.free, "free");
+    for (size_t i = 0; i < n; i++) {
+        void* ptr = ptrs[i];
+        if (!ptr) {
+            continue;
+        }
+        prefault_drop(ptr);
+        if (ptrset_remove(&lazy_owned, ptr)) {
+            libc_lut.free(ptr);
+        } else if (!large_free(ptr) && !pool_free(ptr) && !colour_free(ptr) && !scope_owned(ptr)) {
+            lut.free(ptr);
+        }
+    }
+    count_batch(0, n, 0);
+}
+
+void malloc_glue_free_sized(void* ptr, size_t size, size_t alignment) {
+    if (!ptr) {
+        return;
+    }
+    if (!ext.free_size_aligned || lazy_is_libc(ptr) || large_is_ours(ptr) || pool_is_ours(ptr) ||
+        colour_is_ours(ptr) || scope_owned(ptr)) {
+        free(ptr);
+        return;
+    }
+    count_free();
+    prefault_drop(ptr);
+    ext.free_size_aligned(ptr, size, alignment);
+}
+
+int malloc_glue_prefault_wait(void* ptr) {
+    pthread_mutex_lock(&prefault_lock);
+    prefault_job* job = ptr ? prefault_find(ptr) : NULL;
+    while (job && job->ptr == ptr) {
+        pthread_cond_wait(&prefault_done, &prefault_lock);
+    }
+    pthread_mutex_unlock(&prefault_lock);
+    return job ? 0 : -1;
+}
+
+int malloc_glue_prefault_cancel(void* ptr) {
+    return ptr && prefault_cancel(ptr) ? 0 : -1;
+}
+
+int malloc_glue_numa_node(void) {
+    init();
+    numa_check();
+    return numa_enabled ? tls_numa_node : -1;
 }
 
 /*
@@ -0,0 +1,191 @@
+#ifndef MIMALLOC_GLUE_H
+#define MIMALLOC_GLUE_H
+
+#include <stddef.h>
+
+/**
+ * Extra API exported by libmimalloc-glue.so
+ *
+ * Programs that might run without the glue preloaded should
+ * look these up with dlsym(RTLD_DEFAULT, ...) instead of linking
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Returned by the query functions below
+ * if the backend can't tell us
+ */
+#define MALLOC_GLUE_UNKNOWN ((size_t)-1)
+
+/**
+ * Name of the backend serving allocations
+ */
+const char* malloc_glue_backend(void);
+
+/**
+ * Bytes currently committed by the backend
+ * or MALLOC_GLUE_UNKNOWN
+ */
+size_t malloc_glue_committed_bytes(void);
+
+/**
+ * Calls seen by the wrappers
+ * only counted with MALLOC_GLUE_STATS=1 (or stats=1 in the policy file)
+ */
+typedef struct malloc_glue_stats {
+    size_t allocs;
+    size_t frees;
+    size_t reallocs;
+    // requested, not including strdup() & co
+    size_t bytes;
+} malloc_glue_stats;
+
+void malloc_glue_get_stats(malloc_glue_stats* stats);
+
+/**
+ * Bytes of this process backed by huge pages
+ * (AnonHugePages plus hugetlb pages from /proc/self/smaps_rollup)
+ * or MALLOC_GLUE_UNKNOWN
+ */
+size_t malloc_glue_huge_bytes(void);
+
+/**
+ * Memory pressure seen by the glue (MALLOC_GLUE_PRESSURE=1)
+ * 0 none, 1 moderate, 2 high, 3 critical
+ */
+int malloc_glue_pressure_level(void);
+
+/**
+ * Release callbacks
+ *
+ * Called when an allocation would fail (it's retried afterwards) and
+ * on high memory pressure (MALLOC_GLUE_PRESSURE=1). wanted is roughly
+ * how much memory is needed, the callback returns what it released.
+ * They run by priority (lowest first) until enough was released,
+ * skipping those whose size estimate is down to 0. The estimate is
+ * reduced by what the callback returns, malloc_glue_release_update()
+ * sets it again once the cache has grown.
+ *
+ * Callbacks may free and allocate but must not register or unregister.
+ * Unregistering waits for running callbacks, so after it returns
+ * the callback won't be called again.
+ */
+typedef size_t (*malloc_glue_release_fn)(size_t wanted, void* arg);
+
+/**
+ * Returns an id for the other functions or -1 if the registry is full
+ */
+int malloc_glue_release_register(malloc_glue_release_fn fn, void* arg, int priority, size_t size);
+
+/**
+ * Returns 0 or -1 for unknown ids
+ */
+int malloc_glue_release_update(int id, size_t size);
+int malloc_glue_release_unregister(int id);
+
+/**
+ * Scoped heaps
+ *
+ * Between malloc_glue_scope_begin() and malloc_glue_scope_end() every
+ * allocation of the calling thread comes from a heap of its own, which
+ * end() destroys in one go, freeing all blocks still in it.
+ * Nothing allocated inside a scope may be used after its end, that
+ * includes blocks realloc()ed in it and buffers libc sets up lazily
+ * (e.g. stdio's on the first printf()).
+ * free() of scoped blocks is a no-op with MALLOC_GLUE_SCOPE_FREE=0.
+ *
+ * Scopes nest (up to 16 deep) and must end on the thread that began them.
+ * begin() returns -1 if the backend has no heaps (then allocations are
+ * served as usual and blocks need to be freed), end() returns -1
+ * without an open scope.
+ */
+int malloc_glue_scope_begin(void);
+int malloc_glue_scope_end(void);
+
+/**
+ * Backend heaps
+ *
+ * For code that wants to pick the heap per allocation instead of
+ * switching the thread's default heap (see mimalloc-glue.hpp).
+ * A heap allocates only on the thread that created it, its blocks can
+ * be freed with free() or malloc_glue_free_sized() from any thread.
+ *
+ * malloc_glue_heap_new() returns NULL if the backend has no heaps,
+ * malloc_glue_heap_alloc() with a NULL heap allocates through the
+ * normal wrappers so callers don't need to care.
+ * malloc_glue_heap_delete() keeps the blocks still in the heap alive
+ * (they move to the thread's default heap), malloc_glue_heap_destroy()
+ * frees them.
+ */
+typedef struct malloc_glue_heap malloc_glue_heap;
+
+// alignment every allocation has anyway
+#define MALLOC_GLUE_MIN_ALIGN (2 * sizeof(void*))
+
+malloc_glue_heap* malloc_glue_heap_new(void);
+void malloc_glue_heap_delete(malloc_glue_heap* heap);
+void malloc_glue_heap_destroy(malloc_glue_heap* heap);
+
+/**
+ * alignment must be a power of two, NULL if out of memory
+ */
+void* malloc_glue_heap_alloc(malloc_glue_heap* heap, size_t size, size_t alignment);
+
+/**
+ * Allocation of at most MALLOC_GLUE_SMALL_MAX bytes (with the minimum
+ * alignment) on the backend's small object path, skipping the size
+ * checks of malloc(). For callers that know the size at compile time.
+ */
+#define MALLOC_GLUE_SMALL_MAX (128 * sizeof(void*))
+
+void* malloc_glue_alloc_small(size_t size);
+
+/**
+ * Resize ptr to size bytes without moving it
+ * Returns the usable size of the block (>= size, all of it may be used)
+ * or 0 if it can't be done in place, ptr stays untouched then.
+ * Shrinking always works but keeps the memory in the block.
+ */
+size_t malloc_glue_expand(void* ptr, size_t size);
+
+/**
+ * n allocations of size bytes into out[]
+ * Returns how many succeeded (n unless out of memory)
+ */
+size_t malloc_glue_alloc_batch(size_t size, size_t n, void** out);
+
+/**
+ * free() for all n pointers (NULL entries are skipped)
+ */
+void malloc_glue_free_batch(void** ptrs, size_t n);
+
+/**
+ * free() with the size and alignment the block was allocated with,
+ * passed on to the backend's sized free
+ */
+void malloc_glue_free_sized(void* ptr, size_t size, size_t alignment);
+
+/**
+ * Async prefault (MALLOC_GLUE_PREFAULT=SIZE)
+ * malloc()/calloc() blocks of at least SIZE are faulted in by a
+ * background thread. wait() blocks until ptr is done, cancel() stops
+ * it. Both return 0 if ptr was queued, -1 if it wasn't (anymore).
+ * free() and realloc() cancel on their own.
+ */
+int malloc_glue_prefault_wait(void* ptr);
+int malloc_glue_prefault_cancel(void* ptr);
+
+/**
+ * NUMA node whose heap serves the calling thread
+ * -1 unless running with MALLOC_GLUE_NUMA=1
+ */
+int malloc_glue_numa_node(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MIMALLOC_GLUE_H
@@ -0,0 +1,393 @@
+#ifndef MIMALLOC_GLUE_HPP
+#define MIMALLOC_GLUE_HPP
+
+#include <dlfcn.h>
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include "mimalloc-glue.h"
+
+/**
+ * C++ companion of the glue (header only, C++17)
+ *
+ *   glue::heap_resource     std::pmr resource on a heap of its own
+ *   glue::scoped_resource   monotonic resource, deallocate() is a no-op
+ *                           and the destructor drops the heap at once
+ *   glue::allocator<T>      STL allocator, optionally bound to a heap
+ *   glue::scope             malloc_glue_scope_begin()/end() guard
+ *   glue::alloc<T>() & co   typed allocation, the path is picked from
+ *                           sizeof(T)/alignof(T) at compile time
+ *
+ * Everything goes through the glue's exported functions, looked up
+ * with dlsym() so it works with LD_PRELOAD as well as linked, with
+ * whatever backend the glue picked. Without the glue in the process
+ * it falls back to ::operator new/delete.
+ *
+ * Heaps allocate only on the thread that created them (the resource's
+ * thread), deallocation works from everywhere.
+ */
+namespace glue {
+
+namespace detail {
+
+struct symbols {
+    malloc_glue_heap* (*heap_new)();
+    void (*heap_delete)(malloc_glue_heap*);
+    void (*heap_destroy)(malloc_glue_heap*);
+    void* (*heap_alloc)(malloc_glue_heap*, std::size_t, std::size_t);
+    void (*free_sized)(void*, std::size_t, std::size_t);
+    void* (*alloc_small)(std::size_t);
+    int (*scope_begin)();
+    int (*scope_end)();
+};
+
+template <typename F>
+inline F lookup(const char* name) {
+    return reinterpret_cast<F>(dlsym(RTLD_DEFAULT, name));
+}
+
+inline const symbols& glue() {
+    static const symbols syms = {
+        lookup<decltype(symbols::heap_new)>("malloc_glue_heap_new"),
+        lookup<decltype(symbols::heap_delete)>("malloc_glue_heap_delete"),
+        lookup<decltype(symbols::heap_destroy)>("malloc_glue_heap_destroy"),
+        lookup<decltype(symbols::heap_alloc)>("malloc_glue_heap_alloc"),
+        lookup<decltype(symbols::free_sized)>("malloc_glue_free_sized"),
+        lookup<decltype(symbols::alloc_small)>("malloc_glue_alloc_small"),
+        lookup<decltype(symbols::scope_begin)>("malloc_glue_scope_begin"),
+        lookup<decltype(symbols::scope_end)>("malloc_glue_scope_end"),
+    };
+    return syms;
+}
+
+} // namespace detail
+
+/**
+ * Allocate from heap (nullptr: the thread's default heap)
+ * Throws std::bad_alloc like operator new
+ */
+inline void* allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t),
+                      malloc_glue_heap* heap = nullptr) {
+    const detail::symbols& g = detail::glue();
+    if (!g.heap_alloc || !g.free_sized) {
+        if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return ::operator new(size);
+        }
+        return ::operator new(size, std::align_val_t(alignment));
+    }
+    void* p = g.heap_alloc(heap, size, alignment);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+/**
+ * Free a block from allocate() with the same size and alignment
+ */
+inline void deallocate(void* p, std::size_t size, std::size_t alignment = alignof(std::max_align_t)) noexcept {
+    const detail::symbols& g = detail::glue();
+    if (!g.heap_alloc || !g.free_sized) {
+        if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(p, size);
+        } else {
+            ::operator delete(p, size, std::align_val_t(alignment));
+        }
+        return;
+    }
+    g.free_sized(p, size, alignment);
+}
+
+/**
+ * memory_resource on a heap of its own
+ * Blocks still allocated when it goes away stay valid
+ * (they move to the thread's default heap).
+ * Uses the default heap if the backend has no heaps.
+ */
+class heap_resource : public std::pmr::memory_resource {
+public:
+    heap_resource()
+        : heap_(detail::glue().heap_new ? detail::glue().heap_new() : nullptr) {}
+
+    ~heap_resource() override {
+        if (heap_) {
+            detail::glue().heap_delete(heap_);
+        }
+    }
+
+    heap_resource(const heap_resource&) = delete;
+    heap_resource& operator=(const heap_resource&) = delete;
+
+    malloc_glue_heap* heap() const noexcept { return heap_; }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return glue::allocate(bytes, alignment, heap_);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        glue::deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    malloc_glue_heap* heap_;
+};
+
+/**
+ * memory_resource for the thread's default heap
+ * (a sized-free aware std::pmr::new_delete_resource())
+ */
+class default_heap_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return glue::allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        glue::deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const default_heap_resource*>(&other) != nullptr;
+    }
+};
+
+inline std::pmr::memory_resource* default_resource() noexcept {
+    static default_heap_resource resource;
+    return &resource;
+}
+
+/**
+ * Monotonic resource: deallocate() does nothing, everything is
+ * released at once by release() or the destructor (destroying the heap).
+ * Without heaps it's a std::pmr::monotonic_buffer_resource.
+ */
+class scoped_resource : public std::pmr::memory_resource {
+public:
+    scoped_resource()
+        : heap_(detail::glue().heap_new ? detail::glue().heap_new() : nullptr) {}
+
+    ~scoped_resource() override {
+        if (heap_) {
+            detail::glue().heap_destroy(heap_);
+        }
+    }
+
+    scoped_resource(const scoped_resource&) = delete;
+    scoped_resource& operator=(const scoped_resource&) = delete;
+
+    /**
+     * Free everything allocated so far
+     */
+    void release() {
+        if (!heap_) {
+            fallback_.release();
+            return;
+        }
+        detail::glue().heap_destroy(heap_);
+        heap_ = detail::glue().heap_new();
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (!heap_) {
+            return fallback_.allocate(bytes, alignment);
+        }
+        return glue::allocate(bytes, alignment, heap_);
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    malloc_glue_heap* heap_;
+    std::pmr::monotonic_buffer_resource fallback_;
+};
+
+/**
+ * STL allocator, size and alignment go to the sized free path
+ */
+template <typename T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+    explicit allocator(malloc_glue_heap* heap) noexcept : heap_(heap) {}
+    explicit allocator(const heap_resource& resource) noexcept : heap_(resource.heap()) {}
+
+    template <typename U>
+    allocator(const allocator<U>& other) noexcept : heap_(other.heap()) {}
+
+    T* allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(glue::allocate(n * sizeof(T), alignof(T), heap_));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        glue::deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    malloc_glue_heap* heap() const noexcept { return heap_; }
+
+private:
+    malloc_glue_heap* heap_ = nullptr;
+};
+
+template <typename T, typename U>
+inline bool operator==(const allocator<T>& a, const allocator<U>& b) noexcept {
+    // blocks of any heap can be freed through any allocator
+    (void)a;
+    (void)b;
+    return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const allocator<T>& a, const allocator<U>& b) noexcept {
+    return !(a == b);
+}
+
+/**
+ * Every allocation of this thread goes to a throwaway heap until the
+ * guard goes out of scope (malloc_glue_scope_begin()/end())
+ * active() is false if the glue or the backend can't do scopes
+ */
+class scope {
+public:
+    scope() noexcept
+        : active_(detail::glue().scope_begin && detail::glue().scope_begin() == 0) {}
+
+    ~scope() {
+        if (active_) {
+            detail::glue().scope_end();
+        }
+    }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+    bool active() const noexcept { return active_; }
+
+private:
+    bool active_;
+};
+
+/**
+ * Typed allocation
+ *
+ * new T goes through operator new(size_t) and the backend's malloc()
+ * which has to look at the size at run time. alloc<T>() knows it at
+ * compile time: small, normally aligned types go straight to the
+ * backend's small object path, over-aligned ones to the aligned path,
+ * and free<T>() passes size and alignment to the sized free.
+ *
+ *   Foo* foo = glue::make<Foo>(1, 2);
+ *   glue::destroy(foo);
+ *
+ * Classes get the same for plain new/delete by deriving from
+ * glue::typed_new<Self> (see below).
+ */
+template <typename T>
+inline T* alloc() {
+    constexpr std::size_t size = sizeof(T);
+    constexpr std::size_t alignment = alignof(T);
+    if constexpr (size <= MALLOC_GLUE_SMALL_MAX && alignment <= MALLOC_GLUE_MIN_ALIGN) {
+        const detail::symbols& g = detail::glue();
+        if (g.alloc_small) {
+            void* p = g.alloc_small(size);
+            if (!p) {
+                throw std::bad_alloc();
+            }
+            return static_cast<T*>(p);
+        }
+    }
+    return static_cast<T*>(glue::allocate(size, alignment));
+}
+
+/**
+ * Free storage from alloc<T>() (doesn't run the destructor)
+ */
+template <typename T>
+inline void free(T* p) noexcept {
+    glue::deallocate(p, sizeof(T), alignof(T));
+}
+
+/**
+ * Like new T(args...), no arguments default-initialize like new T
+ */
+template <typename T, typename... Args>
+inline T* make(Args&&... args) {
+    T* p = glue::alloc<T>();
+    try {
+        if constexpr (sizeof...(Args) == 0) {
+            return ::new (static_cast<void*>(p)) T;
+        } else {
+            return ::new (static_cast<void*>(p)) T(std::forward<Args>(args)...);
+        }
+    } catch (...) {
+        glue::free(p);
+        throw;
+    }
+}
+
+template <typename T>
+inline void destroy(T* p) noexcept {
+    if (p) {
+        p->~T();
+        glue::free(p);
+    }
+}
+
+/**
+ * Class-level operator new/delete on top of alloc<T>()
+ *
+ *   class Foo : public glue::typed_new<Foo> { ... };
+ *
+ * Derived classes (of other sizes) still work, they take the
+ * run time sized path.
+ */
+template <typename T>
+struct typed_new {
+    static void* operator new(std::size_t size) {
+        if (size == sizeof(T)) {
+            return glue::alloc<T>();
+        }
+        return glue::allocate(size);
+    }
+
+    static void* operator new(std::size_t size, std::align_val_t alignment) {
+        if (size == sizeof(T) && static_cast<std::size_t>(alignment) == alignof(T)) {
+            return glue::alloc<T>();
+        }
+        return glue::allocate(size, static_cast<std::size_t>(alignment));
+    }
+
+    static void operator delete(void* p, std::size_t size) noexcept {
+        if (size == sizeof(T)) {
+            glue::free(static_cast<T*>(p));
+        } else {
+            glue::deallocate(p, size);
+        }
+    }
+
+    static void operator delete(void* p, std::size_t size, std::align_val_t alignment) noexcept {
+        glue::deallocate(p, size, static_cast<std::size_t>(alignment));
+    }
+};
+
+} // namespace glue
+
+#endif // MIMALLOC_GLUE_HPP
@@ -0,0 +1,88 @@
+#include <string.h>
+
+#include "mimalloc-glue-numa.h"
+#include "test-common.h"
+
+/**
+ * NUMA topology parsing
+ *
+ * Kernel style cpulists and the MALLOC_GLUE_NUMA_FAKE specs,
+ * nothing here needs a NUMA machine.
+ */
+
+static numa_topology topo;
+
+static void reset(void) {
+    memset(&topo, 0, sizeof(topo));
+    memset(topo.cpu_node, -1, sizeof(topo.cpu_node));
+}
+
+static int cpus_on(int node) {
+    int count = 0;
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS; cpu++) {
+        count += topo.cpu_node[cpu] == node;
+    }
+    return count;
+}
+
+static void test_cpulist(void) {
+    reset();
+    CHECK(numa_parse_cpulist("0-3,8,10-11\n", &topo, 1));
+    CHECK(topo.nodes == 2);
+    CHECK(topo.cpu_nodes == 1u << 1);
+    CHECK(cpus_on(1) == 7);
+    CHECK(topo.cpu_node[0] == 1 && topo.cpu_node[3] == 1);
+    CHECK(topo.cpu_node[4] == -1 && topo.cpu_node[9] == -1);
+    CHECK(topo.cpu_node[8] == 1 && topo.cpu_node[11] == 1);
+    CHECK(topo.cpu_node[12] == -1);
+
+    // a node without CPUs (memory only) is fine
+    CHECK(numa_parse_cpulist("\n", &topo, 3));
+    CHECK(topo.nodes == 4);
+    CHECK(topo.cpu_nodes == 1u << 1);
+
+    // CPUs past the table are dropped, not written
+    reset();
+    CHECK(numa_parse_cpulist("4094-5000", &topo, 0));
+    CHECK(cpus_on(0) == 2);
+
+    reset();
+    CHECK(!numa_parse_cpulist("a", &topo, 0));
+    CHECK(!numa_parse_cpulist("0-", &topo, 0));
+    CHECK(!numa_parse_cpulist("-3", &topo, 0));
+    CHECK(!numa_parse_cpulist("0 1", &topo, 0));
+    CHECK(!numa_parse_cpulist("0;1", &topo, 0));
+    CHECK(!numa_parse_cpulist("3-1", &topo, 0));
+}
+
+static void test_fake(void) {
+    CHECK(numa_topology_load(&topo, "0-3;4-7"));
+    CHECK(topo.fake);
+    CHECK(topo.nodes == 2);
+    CHECK(topo.cpu_nodes == 3);
+    CHECK(cpus_on(0) == 4 && cpus_on(1) == 4);
+    CHECK(topo.cpu_node[3] == 0 && topo.cpu_node[4] == 1);
+    CHECK(topo.cpu_node[8] == -1);
+
+    // empty lists leave holes in the node ids
+    CHECK(numa_topology_load(&topo, "0;;2"));
+    CHECK(topo.nodes == 3);
+    CHECK(topo.cpu_nodes == 5);
+
+    CHECK(!numa_topology_load(&topo, "0-3;x"));
+    CHECK(!numa_topology_load(&topo, ""));
+    CHECK(!numa_topology_load(&topo, "0"));
+    CHECK(!numa_topology_load(&topo, "33"));
+
+    // N splits the online CPUs, however many this machine has
+    CHECK(numa_topology_load(&topo, "2"));
+    CHECK(topo.nodes == 2);
+    CHECK(cpus_on(0) > 0);
+    CHECK(cpus_on(0) >= cpus_on(1) && cpus_on(0) - cpus_on(1) <= 1);
+}
+
+int main(void) {
+    test_cpulist();
+    test_fake();
+    return test_finish();
+}
@@ -0,0 +1,205 @@
+#include <fcntl.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mimalloc-glue-policy.h"
+#include "test-common.h"
+
+/**
+ * Policy rules and cache
+ *
+ * Parses single lines, looks up a handful of made up processes in a
+ * text config and checks that the cache built by
+ * `malloc-glue-policy compile` (path in argv[1]) gives the same answers
+ * and is thrown away once it doesn't match the config anymore.
+ */
+
+extern char** environ;
+
+static bool same(const char* a, const char* b) {
+    return (!a && !b) || (a && b && strcmp(a, b) == 0);
+}
+
+static void test_parse_line(void) {
+    policy_rule rule;
+    const char* error = NULL;
+    char line[256];
+
+#define PARSE(text) (strcpy(line, text), policy_parse_line(line, &rule, &error))
+    CHECK(PARSE("") == 0);
+    CHECK(PARSE("   # just a comment") == 0);
+
+    CHECK(PARSE("exe /usr/bin/make backend=skip stats=1 # trailing") == 1);
+    CHECK(rule.match == POLICY_MATCH_EXE);
+    CHECK(!rule.prefix);
+    CHECK(rule.pattern_len == strlen("/usr/bin/make"));
+    CHECK(same(rule.settings.backend, "skip"));
+    CHECK(rule.settings.profile == NULL);
+    CHECK(rule.settings.stats == 1);
+
+    CHECK(PARSE("comm\tpost*\tprofile=memory") == 1);
+    CHECK(rule.match == POLICY_MATCH_COMM);
+    CHECK(rule.prefix);
+    CHECK(rule.pattern_len == 4);
+    CHECK(same(rule.settings.profile, "memory"));
+    CHECK(rule.settings.backend == NULL);
+    CHECK(rule.settings.stats == -1);
+
+    CHECK(PARSE("exe * backend=libc") == 1);
+    CHECK(rule.prefix);
+    CHECK(rule.pattern_len == 0);
+
+    CHECK(PARSE("proc /bin/x backend=libc") == -1);
+    CHECK(PARSE("exe") == -1);
+    CHECK(PARSE("exe /bin/x backend") == -1);
+    CHECK(PARSE("exe /bin/x =libc") == -1);
+    CHECK(PARSE("exe /bin/x backend=") == -1);
+    CHECK(PARSE("exe /bin/x stats=2") == -1);
+    CHECK(PARSE("exe /bin/x colour=1") == -1);
+#undef PARSE
+}
+
+static const char config[] =
+    "# test config\n"
+    "exe    /usr/bin/make                 backend=skip\n"
+    "comm   postgres                      profile=memory\n"
+    "cgroup /system.slice/redis.service   backend=libjemalloc.so.2 stats=1\n"
+    "exe    /opt/bin/lowlat-*             profile=latency\n"
+    "\n"
+    "comm   post*                         stats=0\n";
+
+typedef struct lookup_case {
+    const char* exe;
+    const char* comm;
+    const char* cgroup;
+    // expected settings, found is false if no rule should match
+    bool found;
+    policy_settings want;
+} lookup_case;
+
+static const lookup_case cases[] = {
+    { "/usr/bin/make", "make", "/", true, { "skip", NULL, -1 } },
+    // first match wins
+    { "/usr/bin/make", "postgres", "/", true, { "skip", NULL, -1 } },
+    { "/usr/lib/postgres", "postgres", "/", true, { NULL, "memory", -1 } },
+    { "/usr/sbin/postfix", "postfix", "/", true, { NULL, NULL, 0 } },
+    { "/opt/bin/lowlat-feed", "lowlat-feed", "/", true, { NULL, "latency", -1 } },
+    // prefix doesn't match a shorter name
+    { "/opt/bin/lowlat", "lowlat", "/", false, { NULL, NULL, -1 } },
+    { "/usr/bin/redis-server", "redis-server", "/system.slice/redis.service", true, { "libjemalloc.so.2", NULL, 1 } },
+    { "/bin/true", "true", "/user.slice", false, { NULL, NULL, -1 } },
+};
+
+static void set_process(policy_process* proc, const lookup_case* c) {
+    memset(proc, 0, sizeof(*proc));
+    strcpy(proc->attrs[POLICY_MATCH_EXE], c->exe);
+    strcpy(proc->attrs[POLICY_MATCH_COMM], c->comm);
+    strcpy(proc->attrs[POLICY_MATCH_CGROUP], c->cgroup);
+    proc->loaded = (1u << POLICY_MATCH_COUNT) - 1;
+}
+
+static void check_settings(const lookup_case* c, bool found, const policy_settings* got) {
+    CHECK(found == c->found);
+    if (!found || !c->found) {
+        return;
+    }
+    if (!same(got->backend, c->want.backend) || !same(got->profile, c->want.profile) ||
+        got->stats != c->want.stats) {
+        fprintf(stderr, "%s: got backend=%s profile=%s stats=%d\n", c->exe,
+                got->backend ? got->backend : "-", got->profile ? got->profile : "-", got->stats);
+        test_failures++;
+    }
+}
+
+static bool cache_valid(const void* cache, size_t len, const char* path) {
+    struct stat src;
+    if (stat(path, &src) != 0) {
+        return false;
+    }
+    return policy_cache_valid(cache, len, (uint64_t)src.st_ino, (uint64_t)src.st_size,
+                              (int64_t)src.st_mtim.tv_sec, (int64_t)src.st_mtim.tv_nsec);
+}
+
+static void test_lookup(const char* tool) {
+    char dir[] = "/tmp/malloc-glue-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        test_failures++;
+        return;
+    }
+    char path[256];
+    char cache_path[sizeof(path) + sizeof(POLICY_CACHE_SUFFIX)];
+    snprintf(path, sizeof(path), "%s/malloc-glue.conf", dir);
+    snprintf(cache_path, sizeof(cache_path), "%s%s", path, POLICY_CACHE_SUFFIX);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && write(fd, config, sizeof(config) - 1) == (ssize_t)(sizeof(config) - 1));
+    close(fd);
+
+    static char text[POLICY_MAX_TEXT];
+    policy_process proc;
+    policy_settings got;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        set_process(&proc, &cases[i]);
+        check_settings(&cases[i], policy_lookup_text(path, text, sizeof(text), &proc, &got), &got);
+    }
+
+    // build the cache with the real tool
+    char* args[] = { (char*)tool, "compile", path, NULL };
+    pid_t pid;
+    int status = -1;
+    CHECK(posix_spawn(&pid, tool, NULL, NULL, args, environ) == 0);
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    fd = open(cache_path, O_RDONLY);
+    struct stat st;
+    CHECK(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0);
+    if (fd < 0) {
+        return;
+    }
+    size_t len = (size_t)st.st_size;
+    char* cache = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    CHECK(cache != MAP_FAILED);
+    if (cache == MAP_FAILED) {
+        return;
+    }
+
+    CHECK(cache_valid(cache, len, path));
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        set_process(&proc, &cases[i]);
+        check_settings(&cases[i], policy_lookup_cache(cache, len, &proc, &got), &got);
+    }
+
+    // cut short or with a different magic it's garbage
+    CHECK(!cache_valid(cache, sizeof(policy_cache_header) - 1, path));
+    CHECK(!cache_valid(cache, len - 1, path));
+    ((policy_cache_header*)cache)->magic ^= 1;
+    CHECK(!cache_valid(cache, len, path));
+    ((policy_cache_header*)cache)->magic ^= 1;
+    CHECK(cache_valid(cache, len, path));
+
+    // touching the config makes the cache stale
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 12345, 0 } };
+    CHECK(utimensat(AT_FDCWD, path, times, 0) == 0);
+    CHECK(!cache_valid(cache, len, path));
+
+    munmap(cache, len);
+    unlink(cache_path);
+    unlink(path);
+    rmdir(dir);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <malloc-glue-policy>\n", argv[0]);
+        return 1;
+    }
+    test_parse_line();
+    test_lookup(argv[1]);
+    return test_finish();
+}
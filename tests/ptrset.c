@@ -0,0 +1,174 @@
+#include <pthread.h>
+#include <stdint.h>
+
+#include "mimalloc-glue-ptrset.h"
+#include "test-common.h"
+
+/**
+ * Pointer set churn
+ *
+ * Inserts and removes keys for a long time at a fixed load and checks
+ * that the set agrees with a plain array and that probe chains stay
+ * as short as the load allows (no leftovers from removed keys).
+ * Then does the same with a reader thread looking up keys
+ * that never leave the set while the churn moves entries around.
+ */
+
+#define SLOTS 1024
+#define KEYS 4096
+#define LOAD 400
+
+static atomic_uintptr_t slots[SLOTS];
+static ptrset set = PTRSET_INIT(slots);
+
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// page aligned like most keys in the glue
+static void* key(size_t i) {
+    return (void*)((i + 1) << 12);
+}
+
+/**
+ * Longest run of occupied slots, what a miss has to walk at worst
+ */
+static size_t longest_run(void) {
+    size_t longest = 0;
+    size_t run = 0;
+    // twice around for runs wrapping at the end
+    for (size_t i = 0; i < 2 * SLOTS; i++) {
+        if (atomic_load(&slots[i % SLOTS]) == PTRSET_EMPTY) {
+            run = 0;
+        } else if (++run > longest) {
+            longest = run;
+        }
+    }
+    return longest;
+}
+
+static size_t empty_slots(void) {
+    size_t empty = 0;
+    for (size_t i = 0; i < SLOTS; i++) {
+        empty += atomic_load(&slots[i]) == PTRSET_EMPTY;
+    }
+    return empty;
+}
+
+static void test_churn(void) {
+    static bool in[KEYS];
+    size_t live = 0;
+    size_t worst = 0;
+
+    for (size_t op = 0; op < 1000000; op++) {
+        size_t k = next() % KEYS;
+        if (in[k]) {
+            CHECK(ptrset_remove(&set, key(k)));
+            CHECK(!ptrset_remove(&set, key(k)));
+            in[k] = false;
+            live--;
+        } else if (live < LOAD) {
+            CHECK(ptrset_insert(&set, key(k)));
+            CHECK(!ptrset_insert(&set, key(k)));
+            in[k] = true;
+            live++;
+        }
+        size_t probe = next() % KEYS;
+        CHECK(ptrset_contains(&set, key(probe)) == in[probe]);
+
+        if (op % 10000 == 0) {
+            CHECK(atomic_load(&set.live) == live);
+            CHECK(empty_slots() == SLOTS - live);
+            size_t run = longest_run();
+            if (run > worst) {
+                worst = run;
+            }
+        }
+    }
+    printf("churn: longest run %zu slots at %d/%d load\n", worst, LOAD, SLOTS);
+    // tombstones would have filled the table long ago
+    CHECK(worst < SLOTS / 8);
+
+    for (size_t k = 0; k < KEYS; k++) {
+        if (in[k]) {
+            CHECK(ptrset_remove(&set, key(k)));
+        }
+    }
+    CHECK(atomic_load(&set.live) == 0);
+    CHECK(empty_slots() == SLOTS);
+}
+
+static void test_full(void) {
+    size_t added = 0;
+    while (ptrset_insert(&set, key(added))) {
+        added++;
+    }
+    // one slot always stays empty
+    CHECK(added == SLOTS - 1);
+    CHECK(ptrset_contains(&set, key(0)));
+    CHECK(!ptrset_contains(&set, key(added)));
+    for (size_t k = 0; k < added; k++) {
+        CHECK(ptrset_remove(&set, key(k)));
+    }
+    CHECK(empty_slots() == SLOTS);
+}
+
+#define PINNED 200
+
+static atomic_bool stop;
+static atomic_size_t misses;
+
+static void* reader(void* arg) {
+    (void)arg;
+    size_t i = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (!ptrset_contains(&set, key(KEYS + i % PINNED))) {
+            atomic_fetch_add(&misses, 1);
+        }
+        i++;
+    }
+    return NULL;
+}
+
+static void test_concurrent(void) {
+    static bool in[KEYS];
+    size_t live = 0;
+    for (size_t k = 0; k < PINNED; k++) {
+        CHECK(ptrset_insert(&set, key(KEYS + k)));
+    }
+
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, reader, NULL);
+    }
+    for (size_t op = 0; op < 2000000; op++) {
+        size_t k = next() % KEYS;
+        if (in[k]) {
+            ptrset_remove(&set, key(k));
+            in[k] = false;
+            live--;
+        } else if (live < 3 * SLOTS / 4 - PINNED) {
+            ptrset_insert(&set, key(k));
+            in[k] = true;
+            live++;
+        }
+    }
+    atomic_store(&stop, true);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("concurrent: %zu misses\n", atomic_load(&misses));
+    CHECK(atomic_load(&misses) == 0);
+}
+
+int main(void) {
+    test_churn();
+    test_full();
+    test_concurrent();
+    return test_finish();
+}
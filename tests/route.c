@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "mimalloc-glue-route.h"
+#include "test-common.h"
+
+/**
+ * Routing table
+ *
+ * MALLOC_GLUE_ROUTE specs, the order entries end up in
+ * and which target the lookups pick.
+ */
+
+static void test_parse_size(void) {
+    char* end;
+    CHECK(parse_size("12", &end) == 12 && *end == '\0');
+    CHECK(parse_size("4K", &end) == 4096 && *end == '\0');
+    CHECK(parse_size("2m,", &end) == 2 << 20 && *end == ',');
+    CHECK(parse_size("1G/", &end) == 1 << 30 && *end == '/');
+    CHECK(parse_size("0x10", &end) == 16 && *end == '\0');
+    CHECK(parse_size("3X", &end) == 3 && *end == 'X');
+}
+
+static void test_parse(void) {
+    route_table table = ROUTE_TABLE_INIT;
+    CHECK(route_for(&table, SIZE_MAX, 0) == ROUTE_BACKEND);
+
+    CHECK(route_parse(&table, "thp:2M,large:256M,large:64K/4K") == NULL);
+    CHECK(table.count == 3);
+    // alignment first, then size
+    CHECK(table.entries[0].alignment == 4096 && table.entries[0].size == 64 << 10);
+    CHECK(table.entries[1].target == ROUTE_LARGE && table.entries[1].size == 256 << 20);
+    CHECK(table.entries[2].target == ROUTE_THP && table.entries[2].size == 2 << 20);
+    CHECK(table.min == 2 << 20);
+    CHECK(table.min_align == 4096);
+
+    CHECK(route_for(&table, 1 << 20, 0) == ROUTE_BACKEND);
+    CHECK(route_for(&table, 2 << 20, 0) == ROUTE_THP);
+    CHECK(route_for(&table, 256 << 20, 0) == ROUTE_LARGE);
+    CHECK(route_for(&table, 64 << 10, 4096) == ROUTE_LARGE);
+    CHECK(route_for(&table, 64 << 10, 2048) == ROUTE_BACKEND);
+    CHECK(route_for(&table, 32 << 10, 4096) == ROUTE_BACKEND);
+    // too small for the aligned entry, big enough for thp
+    CHECK(route_for(&table, 3 << 20, 16) == ROUTE_THP);
+}
+
+static void test_hole(void) {
+    route_table table = ROUTE_TABLE_INIT;
+    CHECK(route_parse(&table, "large:64M,backend:1G,pool:0/4K,colour:256K") == NULL);
+    CHECK(route_for(&table, 100 << 20, 0) == ROUTE_LARGE);
+    CHECK(route_for(&table, (size_t)2 << 30, 0) == ROUTE_BACKEND);
+    CHECK(route_for(&table, 512 << 10, 0) == ROUTE_COLOUR);
+    CHECK(route_for(&table, 100, 4096) == ROUTE_POOL);
+    CHECK(route_for(&table, 100, 0) == ROUTE_BACKEND);
+}
+
+static void test_errors(void) {
+    route_table table = ROUTE_TABLE_INIT;
+    const char* spec = "thp:2M,nope:1M";
+    CHECK(route_parse(&table, spec) == spec + 7);
+    // everything before the bad entry stays
+    CHECK(table.count == 1 && table.entries[0].target == ROUTE_THP);
+
+    table = (route_table)ROUTE_TABLE_INIT;
+    CHECK(route_parse(&table, "large") != NULL);
+    CHECK(route_parse(&table, "large:1X") != NULL);
+    CHECK(route_parse(&table, "large:1M/4Kx") != NULL);
+    CHECK(route_parse(&table, "thpx:1M") != NULL);
+    CHECK(table.count == 0);
+    CHECK(route_parse(&table, "") == NULL);
+    CHECK(table.count == 0);
+
+    spec = "large:1,large:2,large:3,large:4,large:5,large:6,large:7,large:8,large:9";
+    CHECK(route_parse(&table, spec) == strstr(spec, "large:9"));
+    CHECK(table.count == ROUTE_MAX);
+    CHECK(!route_add(&table, ROUTE_POOL, 0, 4096));
+    CHECK(table.entries[0].size == 8 && table.entries[ROUTE_MAX - 1].size == 1);
+    CHECK(table.min == 1);
+}
+
+int main(void) {
+    test_parse_size();
+    test_parse();
+    test_hole();
+    test_errors();
+    return test_finish();
+}
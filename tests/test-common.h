@@ -0,0 +1,32 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Helpers shared by all tests
+ *
+ * Every test is a plain program, CHECK() reports a failure and carries on,
+ * test_finish() turns the count into the exit status for ctest.
+ */
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                                      \
+    do {                                                                                 \
+        if (!(cond)) {                                                                   \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);     \
+            test_failures++;                                                             \
+        }                                                                                \
+    } while (0)
+
+static inline int test_finish(void) {
+    if (test_failures) {
+        fprintf(stderr, "%d check(s) failed\n", test_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif // TEST_COMMON_H
@@ -0,0 +1,317 @@
+#!/usr/bin/env python3
+"""
+Store benchmark results and compare runs for regressions
+
+The benchmarks in bench/ write their summary as JSON when
+MALLOC_GLUE_BENCH_JSON is set (bench/run.sh -j does that for you).
+This keeps those files in a results directory keyed by commit and
+host fingerprint:
+
+    <results>/<commit>/<host>/<benchmark>/<backend>/<config>/<timestamp>.json
+
+and compares two commits with a one-sided Mann-Whitney U test over
+all repetitions stored for each metric.
+
+    bench-results.py record -n 10 -- bench/bench-latency -d 2
+    bench-results.py store out/*.json
+    bench-results.py list
+    bench-results.py compare BASE NEW --threshold 5 --threshold malloc_p99.9=20
+
+compare exits with 1 if any metric got significantly worse
+by more than its threshold (in percent).
+"""
+
+import argparse
+import hashlib
+import json
+import math
+import os
+import platform
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+DEFAULT_RESULTS = os.environ.get("MALLOC_GLUE_RESULTS", "bench-results")
+
+
+def git_commit(rev="HEAD"):
+    try:
+        out = subprocess.run(["git", "rev-parse", "--verify", "--quiet", rev + "^{commit}"],
+                             capture_output=True, text=True, check=True)
+        return out.stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def read_first(path, prefix):
+    try:
+        with open(path) as f:
+            for line in f:
+                if line.startswith(prefix):
+                    return line.split(":", 1)[1].strip()
+    except OSError:
+        pass
+    return ""
+
+
+def host_fingerprint():
+    """
+    hostname plus a short hash over everything that makes
+    numbers from two machines incomparable
+    """
+    parts = [
+        read_first("/proc/cpuinfo", "model name"),
+        str(os.cpu_count()),
+        read_first("/proc/meminfo", "MemTotal"),
+        platform.release(),
+    ]
+    digest = hashlib.sha256("\n".join(parts).encode()).hexdigest()[:12]
+    return "%s-%s" % (socket.gethostname().split(".")[0], digest)
+
+
+def safe(name):
+    return "".join(c if c.isalnum() or c in "-_.+" else "_" for c in name)
+
+
+def store_file(results, commit, host, path):
+    with open(path) as f:
+        data = json.load(f)
+    for key in ("benchmark", "backend", "config", "results"):
+        if key not in data:
+            raise ValueError("%s: missing '%s'" % (path, key))
+
+    dest = os.path.join(results, commit, host, safe(data["benchmark"]),
+                        safe(data["backend"]), safe(data["config"]))
+    os.makedirs(dest, exist_ok=True)
+    data["commit"] = commit
+    data["host"] = host
+    data["timestamp"] = time.time()
+    name = "%.6f-%d.json" % (data["timestamp"], os.getpid())
+    with open(os.path.join(dest, name), "w") as f:
+        json.dump(data, f, indent=2)
+    return os.path.join(dest, name)
+
+
+def resolve_commit(results, rev):
+    """
+    accept anything git understands and fall back to
+    a unique prefix of a stored commit
+    """
+    commit = git_commit(rev)
+    if commit and os.path.isdir(os.path.join(results, commit)):
+        return commit
+    stored = [c for c in os.listdir(results) if c.startswith(rev)] if os.path.isdir(results) else []
+    if len(stored) == 1:
+        return stored[0]
+    if len(stored) > 1:
+        sys.exit("ambiguous commit '%s': %s" % (rev, ", ".join(sorted(stored))))
+    sys.exit("no results stored for '%s'" % rev)
+
+
+def load(results, commit, host):
+    """
+    {(benchmark, backend, config, metric): ([values], unit, higher_is_better)}
+    """
+    samples = {}
+    base = os.path.join(results, commit, host)
+    for root, _, files in os.walk(base):
+        for name in files:
+            if not name.endswith(".json"):
+                continue
+            with open(os.path.join(root, name)) as f:
+                data = json.load(f)
+            for r in data["results"]:
+                key = (data["benchmark"], data["backend"], data["config"], r["name"])
+                entry = samples.setdefault(key, ([], r["unit"], r["higher_is_better"]))
+                entry[0].append(float(r["value"]))
+    return samples
+
+
+def mann_whitney_greater(xs, ys):
+    """
+    One-sided Mann-Whitney U test
+    p-value for "values in ys tend to be larger than in xs"
+
+    Exact distribution for small samples without ties,
+    normal approximation with tie correction otherwise.
+    """
+    n1, n2 = len(xs), len(ys)
+    combined = sorted([(v, 0) for v in xs] + [(v, 1) for v in ys])
+    ranks = [0.0] * len(combined)
+    ties = []
+    i = 0
+    while i < len(combined):
+        j = i
+        while j + 1 < len(combined) and combined[j + 1][0] == combined[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2.0 + 1
+        if j > i:
+            ties.append(j - i + 1)
+        i = j + 1
+
+    rank_sum = sum(r for r, (_, group) in zip(ranks, combined) if group == 1)
+    u = rank_sum - n2 * (n2 + 1) / 2.0
+
+    if not ties and n1 <= 20 and n2 <= 20:
+        # counts[k] = number of arrangements with U == k
+        # built up one observation at a time (classic recurrence)
+        counts = exact_u_counts(n1, n2)
+        total = sum(counts)
+        return sum(counts[int(math.ceil(u)):]) / total
+
+    n = n1 + n2
+    mean = n1 * n2 / 2.0
+    tie_term = sum(t ** 3 - t for t in ties) / (n * (n - 1)) if n > 1 else 0
+    var = n1 * n2 / 12.0 * ((n + 1) - tie_term)
+    if var <= 0:
+        return 1.0
+    z = (u - mean - 0.5) / math.sqrt(var)
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+
+def exact_u_counts(n1, n2):
+    # f[i][j] = distribution of U for sample sizes i and j
+    f = {(0, j): [1] for j in range(n2 + 1)}
+    for i in range(1, n1 + 1):
+        f[(i, 0)] = [1]
+        for j in range(1, n2 + 1):
+            a = [0] * j + f[(i - 1, j)]
+            b = f[(i, j - 1)]
+            size = max(len(a), len(b))
+            f[(i, j)] = [(a[k] if k < len(a) else 0) + (b[k] if k < len(b) else 0) for k in range(size)]
+    return f[(n1, n2)]
+
+
+def parse_thresholds(values):
+    default = 5.0
+    per_metric = {}
+    for value in values or []:
+        if "=" in value:
+            metric, pct = value.split("=", 1)
+            per_metric[metric] = float(pct)
+        else:
+            default = float(value)
+    return default, per_metric
+
+
+def cmd_store(args):
+    commit = args.commit or git_commit() or "unknown"
+    host = args.host or host_fingerprint()
+    for path in args.files:
+        print(store_file(args.results, commit, host, path))
+
+
+def cmd_record(args):
+    if not args.command:
+        sys.exit("record: no command given")
+    commit = args.commit or git_commit() or "unknown"
+    host = args.host or host_fingerprint()
+    with tempfile.TemporaryDirectory() as tmp:
+        out = os.path.join(tmp, "result.json")
+        env = dict(os.environ, MALLOC_GLUE_BENCH_JSON=out)
+        for i in range(args.repeat):
+            print("run %d/%d: %s" % (i + 1, args.repeat, " ".join(args.command)), file=sys.stderr)
+            subprocess.run(args.command, env=env, check=True, stdout=subprocess.DEVNULL)
+            store_file(args.results, commit, host, out)
+
+
+def cmd_list(args):
+    if not os.path.isdir(args.results):
+        return
+    for commit in sorted(os.listdir(args.results)):
+        for host in sorted(os.listdir(os.path.join(args.results, commit))):
+            runs = sum(len(files) for _, _, files in os.walk(os.path.join(args.results, commit, host)))
+            print("%s  %s  %d files" % (commit, host, runs))
+
+
+def cmd_compare(args):
+    base = resolve_commit(args.results, args.base)
+    new = resolve_commit(args.results, args.new)
+    host = args.host or host_fingerprint()
+    base_host = args.base_host or host
+
+    old_samples = load(args.results, base, base_host)
+    new_samples = load(args.results, new, host)
+    if not old_samples or not new_samples:
+        sys.exit("nothing to compare for hosts %s / %s" % (base_host, host))
+
+    default, per_metric = parse_thresholds(args.threshold)
+    regressions = 0
+    print("%-44s %14s %14s %8s %8s" % ("metric", "base", "new", "change", "p"))
+    for key in sorted(set(old_samples) & set(new_samples)):
+        old, unit, higher_is_better = old_samples[key]
+        cur = new_samples[key][0]
+        old_median = statistics.median(old)
+        new_median = statistics.median(cur)
+        if old_median != 0:
+            change = (new_median - old_median) / abs(old_median) * 100
+        else:
+            change = 0.0 if new_median == 0 else math.inf
+
+        # a regression is the new run being larger for costs
+        # and smaller for throughputs
+        if higher_is_better:
+            p = mann_whitney_greater(cur, old)
+            worse = -change
+        else:
+            p = mann_whitney_greater(old, cur)
+            worse = change
+
+        threshold = per_metric.get(key[3], default)
+        flag = ""
+        if p < args.alpha and worse > threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif p < args.alpha and worse < -threshold:
+            flag = "  improved"
+        name = "/".join(key)
+        print("%-44s %14.2f %14.2f %+7.1f%% %8.4f %s%s" % (name, old_median, new_median, change, p, unit, flag))
+
+    if regressions:
+        print("%d regression(s)" % regressions, file=sys.stderr)
+        return 1
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--results", default=DEFAULT_RESULTS,
+                        help="results directory (default $MALLOC_GLUE_RESULTS or ./bench-results)")
+    parser.add_argument("--host", help="host fingerprint to use instead of this machine's")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("store", help="store JSON result files")
+    p.add_argument("--commit", help="commit to file results under (default HEAD)")
+    p.add_argument("files", nargs="+")
+    p.set_defaults(func=cmd_store)
+
+    p = sub.add_parser("record", help="run a benchmark repeatedly and store every run")
+    p.add_argument("--commit", help="commit to file results under (default HEAD)")
+    p.add_argument("-n", "--repeat", type=int, default=5)
+    p.add_argument("command", nargs=argparse.REMAINDER)
+    p.set_defaults(func=cmd_record)
+
+    p = sub.add_parser("list", help="list stored commits and hosts")
+    p.set_defaults(func=cmd_list)
+
+    p = sub.add_parser("compare", help="compare two commits, exit 1 on regression")
+    p.add_argument("base")
+    p.add_argument("new")
+    p.add_argument("--base-host", help="host fingerprint of the base run (default same as new)")
+    p.add_argument("--threshold", action="append",
+                   help="allowed slowdown in percent, either global or METRIC=PCT (default 5)")
+    p.add_argument("--alpha", type=float, default=0.05, help="significance level (default 0.05)")
+    p.set_defaults(func=cmd_compare)
+
+    args = parser.parse_args()
+    if getattr(args, "command", None) and args.command[0] == "--":
+        args.command = args.command[1:]
+    return args.func(args) or 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
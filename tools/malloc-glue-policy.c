@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mimalloc-glue-policy.h"
+
+/**
+ * Check, compile and query malloc-glue policy files
+ *
+ *   malloc-glue-policy check   [config]
+ *   malloc-glue-policy compile [config]
+ *   malloc-glue-policy query   [-e exe] [-c comm] [-g cgroup] [config]
+ *
+ * compile writes <config>.cache which the glue picks up as long as
+ * the config file doesn't change. Rerun it after every edit
+ * (the glue falls back to the slower text parsing until then).
+ */
+
+typedef struct rules {
+    policy_rule* rules;
+    size_t count;
+    char* text;
+    struct stat st;
+} rules;
+
+static int load_rules(const char* path, rules* out) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    if (fstat(fileno(file), &out->st) != 0) {
+        perror(path);
+        fclose(file);
+        return 1;
+    }
+
+    out->text = malloc((size_t)out->st.st_size + 1);
+    size_t len = fread(out->text, 1, (size_t)out->st.st_size, file);
+    out->text[len] = '\0';
+    fclose(file);
+
+    out->rules = NULL;
+    out->count = 0;
+    size_t cap = 0;
+    int errors = 0;
+    unsigned lineno = 1;
+    for (char* line = out->text; line && *line; lineno++) {
+        char* end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        if (out->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            out->rules = realloc(out->rules, cap * sizeof(policy_rule));
+        }
+        const char* error;
+        int ret = policy_parse_line(line, &out->rules[out->count], &error);
+        if (ret < 0) {
+            fprintf(stderr, "%s:%u: %s\n", path, lineno, error);
+            errors++;
+        } else if (ret > 0) {
+            out->count++;
+        }
+        line = end ? end + 1 : NULL;
+    }
+    return errors ? 1 : 0;
+}
+
+/**
+ * Growable string table, offsets are what ends up in the cache
+ */
+typedef struct strtab {
+    char* data;
+    size_t len;
+    size_t cap;
+} strtab;
+
+static uint32_t strtab_add(strtab* tab, const char* str, size_t len) {
+    if (!str) {
+        return POLICY_NONE;
+    }
+    while (tab->len + len + 1 > tab->cap) {
+        tab->cap = tab->cap ? tab->cap * 2 : 4096;
+        tab->data = realloc(tab->data, tab->cap);
+    }
+    uint32_t offset = (uint32_t)tab->len;
+    memcpy(tab->data + tab->len, str, len);
+    tab->data[tab->len + len] = '\0';
+    tab->len += len + 1;
+    return offset;
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += ret;
+        len -= (size_t)ret;
+    }
+    return 0;
+}
+
+static int compile(const char* path) {
+    rules r;
+    if (load_rules(path, &r) != 0) {
+        return 1;
+    }
+
+    size_t exact = 0;
+    for (size_t i = 0; i < r.count; i++) {
+        if (!r.rules[i].prefix && r.rules[i].match != POLICY_MATCH_CGROUP) {
+            exact++;
+        }
+    }
+    uint32_t nbuckets = 0;
+    if (exact) {
+        // keep the load factor at or below 1/2
+        nbuckets = 1;
+        while (nbuckets < exact * 2) {
+            nbuckets <<= 1;
+        }
+    }
+
+    uint32_t* buckets = malloc((nbuckets ? nbuckets : 1) * sizeof(uint32_t));
+    uint32_t* tails = malloc((nbuckets ? nbuckets : 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        buckets[i] = tails[i] = POLICY_NONE;
+    }
+    policy_cache_rule* crules = calloc(r.count ? r.count : 1, sizeof(policy_cache_rule));
+    uint32_t* slow = malloc((r.count ? r.count : 1) * sizeof(uint32_t));
+    uint32_t nslow = 0;
+    strtab tab = { NULL, 0, 0 };
+    // offset 0 is never a valid string so a zeroed cache can't match anything
+    strtab_add(&tab, "", 0);
+
+    for (uint32_t i = 0; i < r.count; i++) {
+        policy_rule* rule = &r.rules[i];
+        policy_cache_rule* c = &crules[i];
+        c->pattern = strtab_add(&tab, rule->pattern, rule->pattern_len);
+        c->pattern_len = (uint32_t)rule->pattern_len;
+        c->backend = strtab_add(&tab, rule->settings.backend,
+                                rule->settings.backend ? strlen(rule->settings.backend) : 0);
+        c->profile = strtab_add(&tab, rule->settings.profile,
+                                rule->settings.profile ? strlen(rule->settings.profile) : 0);
+        c->next = POLICY_NONE;
+        c->match = (uint8_t)rule->match;
+        c->prefix = rule->prefix;
+        c->stats = (int8_t)rule->settings.stats;
+
+        if (!rule->prefix && rule->match != POLICY_MATCH_CGROUP) {
+            // append so chains stay in rule order
+            uint32_t bucket = policy_hash(rule->match, rule->pattern, rule->pattern_len) & (nbuckets - 1);
+            if (tails[bucket] == POLICY_NONE) {
+                buckets[bucket] = i;
+            } else {
+                crules[tails[bucket]].next = i;
+            }
+            tails[bucket] = i;
+        } else {
+            slow[nslow++] = i;
+        }
+    }
+
+    policy_cache_header header = {
+        .magic = POLICY_CACHE_MAGIC,
+        .version = POLICY_CACHE_VERSION,
+        .src_ino = (uint64_t)r.st.st_ino,
+        .src_size = (uint64_t)r.st.st_size,
+        .src_mtime_sec = (int64_t)r.st.st_mtim.tv_sec,
+        .src_mtime_nsec = (int64_t)r.st.st_mtim.tv_nsec,
+        .nrules = (uint32_t)r.count,
+        .nbuckets = nbuckets,
+        .nslow = nslow,
+        .strtab_size = (uint32_t)tab.len
+    };
+
+    // write next to it and rename so the glue never sees half a cache
+    size_t len = strlen(path);
+    char* cache = malloc(len + sizeof(POLICY_CACHE_SUFFIX) + 4);
+    char* tmp = malloc(len + sizeof(POLICY_CACHE_SUFFIX) + 4);
+    sprintf(cache, "%s%s", path, POLICY_CACHE_SUFFIX);
+    sprintf(tmp, "%s.tmp", cache);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        return 1;
+    }
+    if (write_all(fd, &header, sizeof(header)) != 0 ||
+        write_all(fd, buckets, nbuckets * sizeof(uint32_t)) != 0 ||
+        write_all(fd, crules, r.count * sizeof(policy_cache_rule)) != 0 ||
+        write_all(fd, slow, nslow * sizeof(uint32_t)) != 0 ||
+        write_all(fd, tab.data, tab.len) != 0 ||
+        fsync(fd) != 0) {
+        perror(tmp);
+        close(fd);
+        unlink(tmp);
+        return 1;
+    }
+    close(fd);
+    if (rename(tmp, cache) != 0) {
+        perror(cache);
+        unlink(tmp);
+        return 1;
+    }
+
+    printf("%s: %zu rules (%zu hashed, %u checked in order)\n", cache, r.count, exact, nslow);
+    return 0;
+}
+
+static void print_settings(const char* source, bool found, const policy_settings* s) {
+    if (!found) {
+        printf("%s: no rule matches\n", source);
+        return;
+    }
+    printf("%s: backend=%s profile=%s stats=%s\n", source,
+           s->backend ? s->backend : "-",
+           s->profile ? s->profile : "-",
+           s->stats < 0 ? "-" : (s->stats ? "1" : "0"));
+}
+
+static int query(const char* path, policy_process* proc) {
+    char* buf = malloc(POLICY_MAX_TEXT);
+    policy_settings settings;
+    bool found = policy_lookup_text(path, buf, POLICY_MAX_TEXT, proc, &settings);
+    print_settings("text", found, &settings);
+
+    char cache[4096];
+    struct stat src;
+    struct stat st;
+    snprintf(cache, sizeof(cache), "%s%s", path, POLICY_CACHE_SUFFIX);
+    int fd = open(cache, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || stat(path, &src) != 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("cache: not available\n");
+        return 0;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(cache);
+        return 1;
+    }
+    if (!policy_cache_valid(map, (size_t)st.st_size, (uint64_t)src.st_ino, (uint64_t)src.st_size,
+                            (int64_t)src.st_mtim.tv_sec, (int64_t)src.st_mtim.tv_nsec)) {
+        printf("cache: stale or invalid, run compile\n");
+        return 0;
+    }
+    found = policy_lookup_cache(map, (size_t)st.st_size, proc, &settings);
+    print_settings("cache", found, &settings);
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s check   [config]\n"
+            "       %s compile [config]\n"
+            "       %s query   [-e exe] [-c comm] [-g cgroup] [config]\n"
+            "config defaults to " POLICY_DEFAULT_PATH "\n",
+            prog, prog, prog);
+}
+
+/**
+ * Pretend to be a process with the given attribute
+ */
+static void set_attr(policy_process* proc, enum policy_match match, const char* value) {
+    snprintf(proc->attrs[match], sizeof(proc->attrs[match]), "%s", value);
+    proc->loaded |= 1u << match;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* cmd = argv[1];
+
+    if (strcmp(cmd, "query") == 0) {
+        policy_process proc = { 0 };
+        int opt;
+        optind = 2;
+        while ((opt = getopt(argc, argv, "e:c:g:")) != -1) {
+            switch (opt) {
+                case 'e': set_attr(&proc, POLICY_MATCH_EXE, optarg); break;
+                case 'c': set_attr(&proc, POLICY_MATCH_COMM, optarg); break;
+                case 'g': set_attr(&proc, POLICY_MATCH_CGROUP, optarg); break;
+                default: usage(argv[0]); return 1;
+            }
+        }
+        return query(optind < argc ? argv[optind] : POLICY_DEFAULT_PATH, &proc);
+    }
+
+    const char* path = argc > 2 ? argv[2] : POLICY_DEFAULT_PATH;
+    if (strcmp(cmd, "check") == 0) {
+        rules r;
+        int ret = load_rules(path, &r);
+        if (ret == 0) {
+            printf("%s: %zu rules\n", path, r.count);
+        }
+        return ret;
+    }
+    if (strcmp(cmd, "compile") == 0) {
+        return compile(path);
+    }
+
+    usage(argv[0]);
+    return 1;
+}